@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Convert client inputs from the in<id>.txt text format to the in<id>.bin
+binary manifest, which the client maps in memory and reads in place (see
+manifest.h). A client uses in<id>.bin when there is one.
+
+usage: convert_manifest.py in1.txt [in2.txt ...]
+"""
+
+import struct
+import sys
+
+MAGIC = b"BTM1"
+NAME_SIZE = 16
+HASH_SIZE = 32
+HEADER = struct.Struct("<4sIII")
+FILE = struct.Struct("<16sIIQ")
+
+
+def encode_name(name):
+    data = name.encode()
+    if not data or len(data) >= NAME_SIZE:
+        raise ValueError("file name %r must be 1 to %d bytes long" % (name, NAME_SIZE - 1))
+    return data
+
+
+def write_manifest(path, owned, wanted):
+    """owned is a list of (name, hashes) pairs, wanted a list of names."""
+    tables = HEADER.size + len(owned) * FILE.size + len(wanted) * NAME_SIZE
+    offset = tables
+
+    with open(path, "wb") as f:
+        f.write(HEADER.pack(MAGIC, len(owned), len(wanted), HASH_SIZE))
+        for name, hashes in owned:
+            f.write(FILE.pack(encode_name(name), len(hashes), 0, offset))
+            offset += len(hashes) * HASH_SIZE
+        for name in wanted:
+            f.write(struct.pack("<16s", encode_name(name)))
+        for name, hashes in owned:
+            for h in hashes:
+                if len(h) != HASH_SIZE:
+                    raise ValueError("hash %r of %s is not %d characters long" % (h, name, HASH_SIZE))
+                f.write(h.encode())
+
+
+def read_text(path):
+    with open(path) as f:
+        words = f.read().split()
+
+    pos = 0
+    owned = []
+    for _ in range(int(words[pos])):
+        name, count = words[pos + 1], int(words[pos + 2])
+        owned.append((name, words[pos + 3:pos + 3 + count]))
+        pos += 2 + count
+    pos += 1
+
+    wanted = words[pos + 1:pos + 1 + int(words[pos])]
+    return owned, wanted
+
+
+def convert(path):
+    owned, wanted = read_text(path)
+    out = path[:-len(".txt")] + ".bin" if path.endswith(".txt") else path + ".bin"
+    write_manifest(out, owned, wanted)
+    return out
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    for path in sys.argv[1:]:
+        convert(path)
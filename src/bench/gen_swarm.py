@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Generate the in<id>.txt inputs (and the file data) of a synthetic swarm.
+
+Clients 1..S are seeders, the rest are leechers. Every file is seeded by
+--replicas seeders, round-robin; every leecher wants a random --overlap
+fraction of the files. Segment hashes are the first 32 hex digits of the
+SHA-256 of each segment, so downloads are verified against real data;
+with --hash-only no data is written and seeders generate it from the hash.
+With --binary the inputs are also written as in<id>.bin binary manifests.
+"""
+
+import argparse
+import hashlib
+import os
+import random
+
+import convert_manifest
+
+
+def add_arguments(parser):
+    parser.add_argument("--clients", type=int, default=8)
+    parser.add_argument("--files", type=int, default=4)
+    parser.add_argument("--segments", type=int, default=100, help="segments per file")
+    parser.add_argument("--segment-size", type=int, default=16384)
+    parser.add_argument("--seeders", type=float, default=0.25, help="fraction of the clients that are seeders")
+    parser.add_argument("--replicas", type=int, default=1, help="seeders per file")
+    parser.add_argument("--overlap", type=float, default=1.0, help="fraction of the files each leecher wants")
+    parser.add_argument("--hash-only", action="store_true", help="do not write the file data")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--binary", action="store_true", help="write binary manifests too (in<id>.bin)")
+
+
+def generate(args, directory):
+    rng = random.Random(args.seed)
+    data_dir = os.path.join(directory, "data")
+    os.makedirs(data_dir, exist_ok=True)
+
+    num_seeders = min(args.clients - 1, max(1, round(args.clients * args.seeders)))
+    names = ["file%d" % f for f in range(args.files)]
+    hashes = {}
+
+    for name in names:
+        data = rng.randbytes(args.segments * args.segment_size)
+        size = args.segment_size
+        hashes[name] = [hashlib.sha256(data[j * size:(j + 1) * size]).hexdigest()[:32]
+                        for j in range(args.segments)]
+        if not args.hash_only:
+            with open(os.path.join(data_dir, name), "wb") as f:
+                f.write(data)
+
+    owned = {c: [] for c in range(1, args.clients + 1)}
+    for f, name in enumerate(names):
+        for r in range(min(args.replicas, num_seeders)):
+            owned[1 + (f + r) % num_seeders].append(name)
+
+    wanted = {c: [] for c in range(1, args.clients + 1)}
+    num_wanted = max(1, round(args.files * args.overlap))
+    for c in range(num_seeders + 1, args.clients + 1):
+        wanted[c] = sorted(rng.sample(names, num_wanted))
+
+    for c in range(1, args.clients + 1):
+        with open(os.path.join(directory, "in%d.txt" % c), "w") as f:
+            f.write("%d\n" % len(owned[c]))
+            for name in owned[c]:
+                f.write("%s %d\n" % (name, args.segments))
+                f.writelines(h + "\n" for h in hashes[name])
+            f.write("%d\n" % len(wanted[c]))
+            f.writelines(name + "\n" for name in wanted[c])
+
+        if args.binary:
+            convert_manifest.write_manifest(os.path.join(directory, "in%d.bin" % c),
+                                            [(name, hashes[name]) for name in owned[c]], wanted[c])
+
+    return wanted
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("directory")
+    add_arguments(parser)
+    args = parser.parse_args()
+    generate(args, args.directory)
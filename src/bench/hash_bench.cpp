@@ -0,0 +1,46 @@
+/* Throughput of segment hashing: the scalar SHA-256 against the multi-buffer kernels.
+   usage: ./hash_bench [segment size] [MiB hashed per kernel] */
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "../sha256.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    size_t segment_size = argc > 1 ? atoi(argv[1]) : 16384;
+    size_t total = (size_t)(argc > 2 ? atoi(argv[2]) : 512) << 20;
+
+    /* a batch of SHA256_MAX_LANES segments, as the download thread verifies them */
+    vector<unsigned char> data(SHA256_MAX_LANES * segment_size);
+    const unsigned char *segments[SHA256_MAX_LANES];
+    unsigned char digests[SHA256_MAX_LANES][SHA256_DIGEST_SIZE];
+
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = rand();
+    }
+    for (int l = 0; l < SHA256_MAX_LANES; l++) {
+        segments[l] = data.data() + l * segment_size;
+    }
+
+    size_t batches = total / data.size();
+    printf("segment size %zu bytes, best kernel: %d lanes\n", segment_size, sha256_best_lanes());
+
+    for (int lanes = 1; lanes <= sha256_best_lanes(); lanes *= 2) {
+        if (lanes == 2)
+            continue;
+
+        auto start = chrono::steady_clock::now();
+        for (size_t b = 0; b < batches; b++) {
+            sha256_multi(segments, SHA256_MAX_LANES, segment_size, digests, lanes);
+        }
+        double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        printf("%-7s %6.3f GB/s\n", lanes == 1 ? "scalar" : lanes == 4 ? "sse2" : "avx2",
+               batches * data.size() / t / 1e9);
+    }
+
+    return 0;
+}
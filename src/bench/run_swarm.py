@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+"""Run a synthetic swarm and append its results to a JSON-lines file.
+
+The inputs are generated with gen_swarm.py in a temporary directory, the
+swarm is run with mpirun and the run report written by main (-j) is
+summarized: wall time, startup time, segments/s per client, tracker
+messages handled and time to the first complete file. Downloaded files
+are checked against the generated data. With --transfer all, the same swarm is run in turn
+with requests to the uploaders, with one-sided MPI_Get (main -r) and with
+copies from the shared memory of the node (main -l). With --slow N, the
+first N clients (seeders) delay every upload by --slow-delay microseconds
+(main -u) and the share of the uploads they still served is reported.
+"""
+
+import argparse
+import json
+import os
+import shlex
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import gen_swarm
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# arguments of main selecting how segments are transferred
+TRANSFER_ARGS = {"send": [], "rma": ["-r"], "shm": ["-l"]}
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], cwd=BENCH_DIR,
+                              capture_output=True, text=True).stdout.strip()
+    except OSError:
+        return ""
+
+
+def run(args, transfer):
+    directory = tempfile.mkdtemp(prefix="swarm_")
+    try:
+        wanted = gen_swarm.generate(args, directory)
+
+        main = ([os.path.abspath(args.main), "-d", "data", "-s", str(args.segment_size),
+                 "-t", str(args.trackers), "-w", str(args.window), "-j", "report.json"]
+                + TRANSFER_ARGS[transfer]
+                + shlex.split(args.main_args))
+
+        # the slow clients are a separate app context, right after the trackers so they are clients 1..N
+        slow = min(args.slow, args.clients)
+        contexts = [(args.trackers, main), (slow, main + ["-u", str(args.slow_delay)]),
+                    (args.clients - slow, main)]
+        command = ["mpirun", "--oversubscribe"] + shlex.split(args.mpirun_args)
+        for i, (np, context) in enumerate(c for c in contexts if c[0] > 0):
+            command += ([":"] if i else []) + ["-np", str(np)] + context
+
+        start = time.time()
+        try:
+            subprocess.run(command, cwd=directory, check=True, timeout=args.timeout)
+        except subprocess.TimeoutExpired:
+            return {"revision": git_revision(), "transfer": transfer, "correct": False, "timed_out": True,
+                    "mpirun_seconds": round(time.time() - start, 3)}
+        mpirun_seconds = time.time() - start
+
+        with open(os.path.join(directory, "report.json")) as f:
+            report = json.load(f)
+
+        correct = True
+        if not args.hash_only:
+            for client, names in wanted.items():
+                for name in names:
+                    output = os.path.join(directory, "client%d_%s" % (client, name))
+                    with open(output, "rb") as a, open(os.path.join(directory, "data", name), "rb") as b:
+                        correct = correct and a.read() == b.read()
+
+        leechers = [c for c in report["clients"] if c["segments"] > 0]
+        uploads = sum(c["uploads"] for c in report["clients"])
+        slow_uploads = sum(c["uploads"] for c in report["clients"] if c["client"] <= slow)
+        rates = [c["segments"] / c["download_seconds"] for c in leechers if c["download_seconds"] > 0]
+        first = [c["first_file_seconds"] for c in leechers if c["first_file_seconds"] >= 0]
+
+        return {
+            "revision": git_revision(),
+            "params": {k: v for k, v in vars(args).items() if k not in ("out", "main", "timeout", "keep", "transfer")},
+            "transfer": transfer,
+            "correct": correct,
+            "mpirun_seconds": round(mpirun_seconds, 3),
+            "wall_seconds": report["wall_seconds"],
+            "startup_seconds": report["startup_seconds"],
+            "segments": sum(c["segments"] for c in report["clients"]),
+            "segments_per_second_per_client": {
+                "mean": statistics.mean(rates) if rates else 0,
+                "min": min(rates) if rates else 0,
+            },
+            "tracker_messages": report["tracker_messages"],
+            "slow_clients": slow,
+            "slow_upload_share": round(slow_uploads / uploads, 4) if uploads else 0,
+            "first_file_seconds": {
+                "min": min(first) if first else -1,
+                "median": statistics.median(first) if first else -1,
+            },
+        }
+    finally:
+        if args.keep:
+            print("swarm kept in", directory)
+        else:
+            shutil.rmtree(directory)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    gen_swarm.add_arguments(parser)
+    parser.add_argument("--trackers", type=int, default=1)
+    parser.add_argument("--window", type=int, default=8)
+    parser.add_argument("--main", default=os.path.join(BENCH_DIR, "..", "main"))
+    parser.add_argument("--transfer", choices=("send", "rma", "shm", "all"), default="send",
+                        help="segments requested from the uploader, fetched with MPI_Get, copied from the "
+                             "node's shared memory, or all of them in turn")
+    parser.add_argument("--slow", type=int, default=0, help="number of slowed clients, the first seeders")
+    parser.add_argument("--slow-delay", type=int, default=2000, help="delay of every upload of a slowed client, in us")
+    parser.add_argument("--main-args", default="", help="extra arguments of main")
+    parser.add_argument("--mpirun-args", default="", help="extra arguments of mpirun")
+    parser.add_argument("--timeout", type=int, default=600)
+    parser.add_argument("--out", default=os.path.join(BENCH_DIR, "results.jsonl"))
+    parser.add_argument("--keep", action="store_true", help="keep the swarm directory")
+    parser.add_argument("--check", action="store_true",
+                        help="exit with status 1 if a run timed out or downloaded a wrong file")
+    args = parser.parse_args()
+
+    transfers = tuple(TRANSFER_ARGS) if args.transfer == "all" else (args.transfer,)
+    failed = []
+
+    for transfer in transfers:
+        result = run(args, transfer)
+        if not result["correct"]:
+            failed.append(transfer)
+
+        with open(args.out, "a") as f:
+            f.write(json.dumps(result) + "\n")
+        print(json.dumps(result, indent=2))
+
+    if args.check and failed:
+        print("failed:", " ".join(failed), file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
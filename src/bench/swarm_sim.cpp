@@ -0,0 +1,577 @@
+/* Deterministic discrete-event simulation of swarms, to evaluate the scheduling policies of the client
+   (piece picking, peer selection, request window) without mpirun. The client, uploader queue and tracker
+   logic is the real one: their messages go through a message transport (see message.h) into an event
+   queue, delayed by the latency of the two ends; a segment also takes its size over the slower of the
+   uploader's upload and the downloader's download bandwidth, each uploader sending one segment at a time.
+   The download window runs the endgame of main.cpp (duplicate requests, cancelled once a copy arrives)
+   and rejects the corrupted segments that -x uploaders send, as main does when a hash does not match.
+   The peers are simulated in independent swarms of -g peers sharing one file, one swarm after the other.
+   Every peer of a swarm learns of all the others from the tracker and keeps per-peer state for each
+   (picker rows, peer stats, choker), so memory grows with the square of the swarm size: -n sets how many
+   peers are simulated in all, -g how large a swarm is (a few thousand peers at most). Same seed, same
+   output.
+   usage: ./swarm_sim [-n peers] [-g peers per swarm] [-c seeders per swarm] [-s segments] [-z segment size]
+                      [-w window] [-u upload MB/s] [-d download MB/s] [-l latency ms]
+                      [-f fraction of slow uploaders, 10 times slower] [-e seed]
+                      [-k: choke, as main -k] [-b KB/s sent to each peer at most, as main -b]
+                      [-x fraction of uploaders that corrupt half the segments they send] */
+#include <getopt.h>
+#include <chrono>
+#include <queue>
+#include <random>
+
+#include "../utils.h"
+
+#define SIM_FILE "file"
+
+enum {
+    /* a message sent through the transport reaches its destination */
+    EVENT_MESSAGE,
+    /* an uploader is done sending its current segment, or (value 1) a deferred requester can be served */
+    EVENT_UPLOADED,
+    /* the reply to a segment request reaches the downloader */
+    EVENT_REPLY,
+};
+
+typedef struct {
+    double time;
+    /* order of scheduling, which breaks ties so that runs are reproducible */
+    long seq;
+    int type;
+    /* the rank the event happens at, and the rank it comes from */
+    int peer;
+    int from;
+    int tag;
+    /* EVENT_MESSAGE: index of the message in in_transit; EVENT_REPLY: requests queued at the uploader */
+    int value;
+    /* EVENT_REPLY: bytes of segment in the reply, 0 for an empty one */
+    int size;
+    /* EVENT_REPLY: the segment does not match its hash */
+    bool corrupted;
+} event;
+
+struct later {
+    bool operator()(const event &a, const event &b) const {
+        return a.time > b.time || (a.time == b.time && a.seq > b.seq);
+    }
+};
+
+/* A simulated client: the state of the download thread, the upload queue and the link model. */
+typedef struct {
+    vector<client_file> files;
+    map<string, int> file_ids;
+    map<string, vector<char>> hashes;
+    peer_stats load;
+    client_scratch scratch;
+    send_pool pool;
+    vector<pair<int, int>> fresh;
+    vector<download_slot> slots;
+    vector<char> data;
+    int in_flight, needed, updated;
+    /* peer lists still awaited from the tracker */
+    int lists;
+    peer_queue queue;
+    choker choke;
+    bool uploading;
+    work_item upload;
+    /* bytes per second and seconds */
+    double upload_rate, download_rate, latency;
+    /* the uploader corrupts half the segments it sends (-x) */
+    bool corrupts;
+    /* when all the wanted files were complete, -1 until then */
+    double done;
+} sim_peer;
+
+/* the swarm being simulated: rank 0 is the tracker, ranks 1 .. seeders the seeds, the others download */
+vector<sim_peer> peers;
+tracker_index swarms;
+send_pool tracker_replies;
+int num_ranks;
+
+priority_queue<event, vector<event>, later> events;
+vector<vector<char>> in_transit;
+vector<int> free_messages;
+double now;
+long num_events;
+long next_seq;
+
+/* the rank whose code is running, the source of the messages it sends */
+int current;
+
+int window = DOWNLOAD_WINDOW;
+int segment_size = SEGMENT_SIZE;
+bool choke_uploads = false;
+double upload_rate = 0;
+mt19937_64 rng;
+
+static void schedule(double time, int type, int peer, int from, int tag, int value, int size, bool corrupted = false) {
+    events.push({time, next_seq++, type, peer, from, tag, value, size, corrupted});
+}
+
+/* The clock of the upload queues. */
+static double sim_clock() {
+    return now;
+}
+
+static double link_latency(int a, int b) {
+    return (peers[a].latency + peers[b].latency) / 2;
+}
+
+/* The transport: the message reaches dest after the latency of the link. */
+static void deliver(const char *data, size_t len, int dest, int tag) {
+    int m;
+    if (free_messages.empty()) {
+        m = in_transit.size();
+        in_transit.emplace_back();
+    } else {
+        m = free_messages.back();
+        free_messages.pop_back();
+    }
+
+    in_transit[m].assign(data, data + len);
+    schedule(now + link_latency(current, dest), EVENT_MESSAGE, dest, current, tag, m, 0);
+}
+
+static bool wanted_complete(sim_peer &p) {
+    for (client_file &file: p.files) {
+        if (file.num_segments == 0 || file.missing > 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* next_segment of main.cpp: the files in order, a segment from the picker and the holder to ask, then the
+   duplicates of the endgame. */
+static bool next_segment(sim_peer &p, int &file, int &segment, int &peer_rank) {
+    static const vector<bool> no_local;
+
+    for (int id = 0; id < (int)p.files.size(); id++) {
+        if (!p.files[id].downloading || p.files[id].missing == 0)
+            continue;
+
+        segment = pick_request(p.files[id].picker, p.load, no_local, peer_rank);
+        if (segment == -1)
+            continue;
+
+        file = id;
+        return true;
+    }
+
+    return next_duplicate(p.slots, p.files, p.load, file, segment, peer_rank);
+}
+
+/* The end of a round of the download loop: announce and report the received segments, then ask the
+   tracker for the peers again. */
+static void next_round(sim_peer &p) {
+    send_haves(p.fresh, p.files, current, p.scratch, p.pool);
+    send_updates(p.files, p.scratch, 1);
+
+    p.updated = 0;
+    forget_chokes(p.load);
+    p.lists = send_request_to_tracker(p.files, p.scratch, 1);
+}
+
+/* Keep the window full until the round ends, as the download loop does. */
+static void continue_download(sim_peer &p) {
+    if (p.lists > 0 || p.done >= 0)
+        return;
+
+    if (p.needed == 0 && wanted_complete(p)) {
+        send_haves(p.fresh, p.files, current, p.scratch, p.pool);
+        send_updates(p.files, p.scratch, 1);
+        p.done = now;
+        choker_seeding(p.choke);
+        return;
+    }
+
+    if (p.updated >= UPDATE_INTERVAL) {
+        next_round(p);
+        return;
+    }
+
+    for (int i = 0; i < window; i++) {
+        download_slot &slot = p.slots[i];
+        if (slot.busy)
+            continue;
+
+        if (!next_segment(p, slot.file, slot.segment, slot.peer))
+            break;
+
+        client_file &file = p.files[slot.file];
+        MPI_Request request;
+
+        slot.busy = true;
+        slot.cancelled = false;
+        slot.requested = now;
+        peer_request_sent(p.load, slot.peer);
+        send_file_request(file.name.c_str(), file.hashes + (size_t)slot.segment * HASH_SIZE, slot.segment, slot.peer,
+                          TAG_SEGMENT_BASE + i, p.data, &request);
+        p.in_flight++;
+    }
+
+    /* none of the missing segments are available yet, ask the tracker again */
+    if (p.in_flight == 0)
+        next_round(p);
+}
+
+static void receive_peer_list(sim_peer &p, const char *data) {
+    parse_list_from_tracker(data, current, num_ranks, p.files, p.file_ids, p.hashes, p.scratch);
+
+    /* the pickers of new downloads are seeded by rank; draw their seeds from the run's instead, so that the
+       swarms do not all pick alike */
+    for (client_file &file: p.files) {
+        if (file.downloading && file.num_segments == 0)
+            file.picker.seed = rng();
+    }
+
+    if (--p.lists > 0)
+        return;
+
+    update_missing_segments(p.files, &p.needed);
+    continue_download(p);
+}
+
+/* Send the next queued segment of the uploader: the reply leaves once the segment is sent, with the number
+   of requests still queued, and the uploader goes on with the next one. If every requester waiting is
+   deferred (-b), the uploader idles until the first of them is due. */
+static void start_upload(sim_peer &p) {
+    char filename[MAX_FILENAME+1];
+    int segment, reply_tag;
+    double wait;
+
+    p.uploading = peer_queue_try_pop(p.queue, p.upload, &wait);
+    if (!p.uploading) {
+        if (wait >= 0)
+            schedule(now + wait, EVENT_UPLOADED, current, current, 0, 1, 0);
+        return;
+    }
+    parse_file_request(p.upload.data.data(), filename, &segment, &reply_tag);
+
+    /* a cancelled request gets an empty reply, as from upload_worker_func */
+    auto it = p.file_ids.find(filename);
+    bool owned = p.upload.tag == TAG_REQUEST && it != p.file_ids.end() && segment >= 0 &&
+                 segment < p.files[it->second].num_segments && bitfield_test(p.files[it->second].owned, segment);
+
+    int dest = p.upload.source;
+    int size = owned ? segment_size : 0;
+    bool corrupted = owned && p.corrupts && rng() % 2;
+    double sent = now + size / min(p.upload_rate, peers[dest].download_rate);
+
+    if (size > 0 && (choke_uploads || upload_rate > 0)) {
+        double wait = choker_shape(p.choke, dest, size, now);
+        if (wait > 0)
+            peer_queue_defer(p.queue, dest, wait);
+    }
+
+    schedule(sent + link_latency(current, dest), EVENT_REPLY, dest, current, reply_tag, peer_queue_size(p.queue), size,
+             corrupted);
+    schedule(sent, EVENT_UPLOADED, current, current, 0, 0, 0);
+}
+
+static void receive_request(sim_peer &p, int source, vector<char> &data) {
+    work_item item;
+    char filename[MAX_FILENAME+1];
+    int segment;
+
+    item.source = source;
+    item.tag = TAG_REQUEST;
+    parse_file_request(data.data(), filename, &segment, &item.key);
+    item.data.swap(data);
+
+    if (choke_uploads && segment >= 0 && !choker_admit(p.choke, source, now)) {
+        schedule(now + link_latency(current, source), EVENT_REPLY, source, current, item.key, REPLY_CHOKED, 0);
+        return;
+    }
+
+    /* the peer's queue is full, it gets an empty reply at once */
+    if (!peer_queue_push(p.queue, item)) {
+        schedule(now + link_latency(current, source), EVENT_REPLY, source, current, item.key, peer_queue_size(p.queue), 0);
+        return;
+    }
+
+    if (!p.uploading)
+        start_upload(p);
+}
+
+static void receive_cancel(sim_peer &p, int source, const char *data) {
+    char filename[MAX_FILENAME+1];
+    int segment, reply_tag;
+
+    parse_cancel(data, filename, &segment, &reply_tag);
+    peer_queue_retag(p.queue, source, reply_tag, filename, segment, TAG_CANCEL);
+}
+
+/* The reply handling of the download loop: an empty reply puts the segment back, a corrupted one demotes
+   its uploader, the first valid copy cancels the other requests for the segment. */
+static void receive_reply(sim_peer &p, event &e) {
+    int i = e.tag - TAG_SEGMENT_BASE;
+    download_slot &slot = p.slots[i];
+    client_file &file = p.files[slot.file];
+
+    slot.busy = false;
+    p.in_flight--;
+
+    int queued = e.value;
+    if (queued == REPLY_CHOKED) {
+        peer_choked(p.load, e.from);
+        queued = -1;
+    }
+
+    bool timed = e.size == segment_size;
+    peer_reply_received(p.load, e.from, timed ? now - slot.requested : -1, queued);
+
+    if (slot.cancelled || bitfield_test(file.owned, slot.segment)) {
+        /* another copy of the segment won the endgame */
+    } else if (e.size == 0) {
+        unpick_segment(file.picker, slot.segment);
+    } else if (e.corrupted) {
+        reject_segment(file.picker, e.from, slot.segment, p.load);
+    } else {
+        cancel_duplicates(p.slots, p.files, i, false, p.data);
+        picker_segment_done(file.picker, slot.segment);
+        bitfield_set(file.owned, slot.segment);
+        bitfield_set(file.updated, slot.segment);
+        file.missing--;
+
+        if (choke_uploads)
+            choker_received(p.choke, e.from, segment_size);
+
+        if (file.missing == 0)
+            send_file_downloaded(file.name.c_str(), 1, p.data);
+
+        p.fresh.emplace_back(slot.file, slot.segment);
+        p.updated++;
+        p.needed--;
+
+        if ((int)p.fresh.size() >= HAVE_BATCH)
+            send_haves(p.fresh, p.files, current, p.scratch, p.pool);
+    }
+
+    continue_download(p);
+}
+
+static void handle(event &e) {
+    current = e.peer;
+
+    if (e.type == EVENT_MESSAGE) {
+        vector<char> &data = in_transit[e.value];
+
+        if (e.peer == TRACKER_RANK) {
+            vector<char> reply;
+
+            if (e.tag == TAG_REQUEST)
+                send_peer_list(data.data(), e.from, swarms, reply, tracker_replies);
+            else if (e.tag == TAG_UPDATE)
+                parse_update(data.data(), e.from, swarms);
+        } else {
+            sim_peer &p = peers[e.peer];
+
+            if (e.tag == TAG_PEER_LIST)
+                receive_peer_list(p, data.data());
+            else if (e.tag == TAG_HAVE)
+                parse_haves(data.data(), e.from, p.files, p.file_ids);
+            else if (e.tag == TAG_REQUEST)
+                receive_request(p, e.from, data);
+            else if (e.tag == TAG_CANCEL)
+                receive_cancel(p, e.from, data.data());
+        }
+
+        free_messages.push_back(e.value);
+
+    } else if (e.type == EVENT_UPLOADED) {
+        /* a deferred requester is due, unless the uploader got busy with another one meanwhile */
+        if (e.value == 0 || !peers[e.peer].uploading)
+            start_upload(peers[e.peer]);
+
+    } else if (e.type == EVENT_REPLY) {
+        receive_reply(peers[e.peer], e);
+    }
+}
+
+typedef struct {
+    int size;
+    int seeders;
+    int segments;
+    double upload, download, latency, slow, corrupt;
+} swarm_params;
+
+static void init_peer(sim_peer &p, int rank, swarm_params &params, vector<char> &hashes) {
+    uniform_real_distribution<double> spread(0.5, 1.5);
+    uniform_real_distribution<double> coin(0, 1);
+
+    p.upload_rate = params.upload * spread(rng);
+    if (coin(rng) < params.slow)
+        p.upload_rate /= 10;
+    p.corrupts = coin(rng) < params.corrupt;
+    p.download_rate = params.download * spread(rng);
+    p.latency = params.latency * spread(rng);
+
+    init_peer_stats(p.load, num_ranks);
+    init_client_scratch(p.scratch, 1, num_ranks);
+    init_peer_queue(p.queue, UPLOAD_QUEUE_DEPTH);
+    p.queue.clock = sim_clock;
+    init_choker(p.choke, num_ranks, upload_rate, rng());
+    p.slots.resize(window);
+    for (download_slot &slot: p.slots) {
+        slot.busy = slot.cancelled = false;
+    }
+    p.in_flight = p.needed = p.updated = p.lists = 0;
+    p.uploading = false;
+    p.done = -1;
+
+    p.file_ids[SIM_FILE] = 0;
+    p.files.emplace_back();
+
+    client_file &file = p.files.back();
+    file.name = SIM_FILE;
+    file.num_segments = 0;
+    file.missing = 0;
+    file.hashes = NULL;
+    file.view = {0, 0};
+    file.shard = TRACKER_RANK;
+    file.downloading = false;
+    file.store = NULL;
+    file.shared = NULL;
+
+    if (rank > params.seeders)
+        return;
+
+    /* a seed: the tracker indexes its manifest before the swarm starts */
+    choker_seeding(p.choke);
+    vector<char> manifest;
+    file.num_segments = params.segments;
+    file.hashes = hashes.data();
+    bitfield_fill(file.owned, params.segments);
+
+    put_int(manifest, 1);
+    put_manifest_file(manifest, SIM_FILE, params.segments, file.hashes);
+    add_files_to_index(manifest.data(), rank, swarms);
+}
+
+/* Simulate one swarm to completion, adding the completion time of each downloader to done (-1 for those
+   that never finished). */
+static void simulate_swarm(swarm_params &params, vector<double> &done) {
+    vector<char> hashes((size_t)params.segments * HASH_SIZE, 'a');
+
+    num_ranks = params.size + 1;
+    peers.clear();
+    peers.resize(num_ranks);
+    swarms = tracker_index();
+    peers[TRACKER_RANK].latency = params.latency;
+
+    for (int r = 1; r < num_ranks; r++) {
+        init_peer(peers[r], r, params, hashes);
+    }
+
+    now = 0;
+    for (int r = params.seeders + 1; r < num_ranks; r++) {
+        current = r;
+        peers[r].lists = send_request_to_tracker(peers[r].files, peers[r].scratch, 1);
+    }
+
+    while (!events.empty()) {
+        event e = events.top();
+        events.pop();
+
+        now = e.time;
+        num_events++;
+        handle(e);
+    }
+
+    for (int r = params.seeders + 1; r < num_ranks; r++) {
+        done.push_back(peers[r].done);
+    }
+}
+
+static double percentile(vector<double> &sorted, double p) {
+    return sorted[min((size_t)(p * sorted.size()), sorted.size() - 1)];
+}
+
+int main(int argc, char *argv[]) {
+    int num_peers = 1000;
+    int swarm_size = 100;
+    unsigned long seed = 1;
+    swarm_params params = {0, 2, 200, 10, 40, 1, 0, 0};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:g:c:s:z:w:u:d:l:f:e:kb:x:")) != -1) {
+        switch (opt) {
+        case 'n': num_peers = atoi(optarg); break;
+        case 'g': swarm_size = atoi(optarg); break;
+        case 'c': params.seeders = atoi(optarg); break;
+        case 's': params.segments = atoi(optarg); break;
+        case 'z': segment_size = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'u': params.upload = atof(optarg); break;
+        case 'd': params.download = atof(optarg); break;
+        case 'l': params.latency = atof(optarg); break;
+        case 'f': params.slow = atof(optarg); break;
+        case 'e': seed = strtoul(optarg, NULL, 10); break;
+        case 'k': choke_uploads = true; break;
+        case 'b': upload_rate = atof(optarg) * 1024; break;
+        case 'x': params.corrupt = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n peers] [-g peers per swarm] [-c seeders per swarm] [-s segments] "
+                    "[-z segment size] [-w window] [-u upload MB/s] [-d download MB/s] [-l latency ms] "
+                    "[-f slow fraction] [-e seed] [-k] [-b KB/s] [-x corrupt fraction]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_peers < 1 || swarm_size < 2 || params.seeders < 1 || params.segments < 1 || segment_size < 1 || window < 1) {
+        fprintf(stderr, "swarm_sim: every swarm needs a seed and a downloader\n");
+        return 1;
+    }
+
+    set_message_transport(deliver);
+
+    swarm_params units = params;
+    units.upload *= 1e6;
+    units.download *= 1e6;
+    units.latency /= 1e3;
+
+    vector<double> done;
+    auto start = chrono::steady_clock::now();
+
+    for (int first = 0, g = 0; first < num_peers; first += swarm_size, g++) {
+        seed_seq seq{seed, (unsigned long)g};
+        rng.seed(seq);
+
+        units.size = min(swarm_size, num_peers - first);
+        units.seeders = min(params.seeders, units.size);
+        simulate_swarm(units, done);
+    }
+
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    /* the downloaders that never finished are counted apart, the times are those of the others */
+    vector<double> finished;
+    double sum = 0;
+    for (double t: done) {
+        if (t >= 0) {
+            finished.push_back(t);
+            sum += t;
+        }
+    }
+    sort(finished.begin(), finished.end());
+    int unfinished = done.size() - finished.size();
+
+    printf("{\"peers\": %d, \"swarm\": %d, \"seeders\": %d, \"segments\": %d, \"segment_size\": %d, \"window\": %d, "
+           "\"upload_mbps\": %g, \"download_mbps\": %g, \"latency_ms\": %g, \"slow\": %g, \"corrupt\": %g, \"seed\": %lu, "
+           "\"choke\": %s, \"peer_rate_kbps\": %g, \"downloaders\": %zu, \"unfinished\": %d, \"events\": %ld",
+           num_peers, swarm_size, params.seeders, params.segments, segment_size, window, params.upload,
+           params.download, params.latency, params.slow, params.corrupt, seed, choke_uploads ? "true" : "false", upload_rate / 1024,
+           done.size(), unfinished, num_events);
+    if (!finished.empty()) {
+        printf(", \"completion_seconds\": {\"mean\": %.6f, \"min\": %.6f, \"p10\": %.6f, \"p50\": %.6f, "
+               "\"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f}",
+               sum / finished.size(), finished.front(), percentile(finished, 0.1), percentile(finished, 0.5),
+               percentile(finished, 0.9), percentile(finished, 0.99), finished.back());
+    }
+    printf("}\n");
+
+    fprintf(stderr, "simulated %d peers in %.2f s, %.0f events/s\n", num_peers, wall, num_events / wall);
+
+    return 0;
+}
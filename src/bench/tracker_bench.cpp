@@ -0,0 +1,100 @@
+/* Micro-benchmark of the tracker index: manifests, updates and peer-list serialization.
+   usage: ./tracker_bench [files] [peers] [segments per file]
+   The messages have the shape of the current wire format: an update carries UPDATE_INTERVAL files of one
+   changed bitfield word each (file id, first word, word count, word), a peer-list request one file seen
+   at version 0, so its reply holds every peer of the swarm with its bitfield (about 17 KB with the
+   defaults). With the defaults, on one core, this measures about 20k to 26k updates/s and 11k to 15k
+   peer lists/s; the figures in the commit that added the bench (~93k and ~57k) were taken with the
+   earlier message shapes and no longer apply. */
+#include <chrono>
+#include <random>
+
+#include "../utils.h"
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    int num_files = argc > 1 ? atoi(argv[1]) : 10000;
+    int num_peers = argc > 2 ? atoi(argv[2]) : 1000;
+    int num_segments = argc > 3 ? atoi(argv[3]) : 64;
+
+    tracker_index swarms;
+    mt19937 rng(42);
+    vector<vector<char>> messages;
+    vector<char> data;
+    char filename[MAX_FILENAME+1];
+    vector<char> hashes((size_t)num_segments * HASH_SIZE, 'a');
+
+    /* each file is seeded by one peer, each peer sends one manifest */
+    messages.assign(num_peers + 1, vector<char>());
+    vector<int> files_of_peer(num_peers + 1, 0);
+    for (int f = 0; f < num_files; f++) {
+        files_of_peer[1 + f % num_peers]++;
+    }
+    for (int r = 1; r <= num_peers; r++) {
+        put_int(messages[r], files_of_peer[r]);
+    }
+    for (int f = 0; f < num_files; f++) {
+        vector<char> &msg = messages[1 + f % num_peers];
+        sprintf(filename, "f%d", f);
+        put_manifest_file(msg, filename, num_segments, hashes.data());
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (int r = 1; r <= num_peers; r++) {
+        add_files_to_index(messages[r].data(), r, swarms);
+    }
+    double t = seconds_since(start);
+    printf("manifests: %d files in %.3f s, %.0f files/s\n", num_files, t, num_files / t);
+
+    /* updates of UPDATE_INTERVAL random segments of random files, from random peers */
+    int num_updates = 200000;
+    messages.assign(num_updates, vector<char>());
+    vector<int> sources(num_updates);
+    for (int u = 0; u < num_updates; u++) {
+        sources[u] = 1 + rng() % num_peers;
+        put_int(messages[u], UPDATE_INTERVAL);
+        for (int i = 0; i < UPDATE_INTERVAL; i++) {
+            sprintf(filename, "f%d", (int)(rng() % num_files));
+            int segment = rng() % num_segments;
+            uint64_t word = (uint64_t)1 << (segment % 64);
+
+            put_int(messages[u], find_file(swarms, filename));
+            put_int(messages[u], segment / 64);
+            put_int(messages[u], 1);
+            put_words(messages[u], &word, 1);
+        }
+    }
+
+    start = chrono::steady_clock::now();
+    for (int u = 0; u < num_updates; u++) {
+        parse_update(messages[u].data(), sources[u], swarms);
+    }
+    t = seconds_since(start);
+    printf("updates: %d messages (%d segments) in %.3f s, %.0f messages/s\n",
+           num_updates, num_updates * UPDATE_INTERVAL, t, num_updates / t);
+
+    /* peer-list requests for one random file each */
+    int num_requests = 100000;
+    messages.assign(num_requests, vector<char>());
+    for (int q = 0; q < num_requests; q++) {
+        sprintf(filename, "f%d", (int)(rng() % num_files));
+        put_int(messages[q], 1);
+        put_string(messages[q], filename);
+        put_int(messages[q], 0);
+    }
+
+    size_t bytes = 0;
+    start = chrono::steady_clock::now();
+    for (int q = 0; q < num_requests; q++) {
+        build_peer_list(messages[q].data(), 0, data, swarms);
+        bytes += data.size();
+    }
+    t = seconds_since(start);
+    printf("peer lists: %d requests in %.3f s, %.0f requests/s, %.0f bytes/response\n",
+           num_requests, t, num_requests / t, (double)bytes / num_requests);
+
+    return 0;
+}
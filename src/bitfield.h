@@ -0,0 +1,49 @@
+#ifndef __BITFIELD_H__
+#define __BITFIELD_H__
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/* One bit per segment, 64 segments per word. */
+static inline int bitfield_words(int num_segments) {
+    return (num_segments + 63) / 64;
+}
+
+static inline bool bitfield_test(const vector<uint64_t> &bits, int segment) {
+    return (bits[segment / 64] >> (segment % 64)) & 1;
+}
+
+/* Set the bit of segment, returns true if it was not already set. */
+static inline bool bitfield_set(vector<uint64_t> &bits, int segment) {
+    uint64_t mask = (uint64_t)1 << (segment % 64);
+    uint64_t &word = bits[segment / 64];
+
+    if (word & mask)
+        return false;
+
+    word |= mask;
+    return true;
+}
+
+/* Mask of the bits of word w that stand for one of the num_segments segments. */
+static inline uint64_t bitfield_word_mask(int num_segments, int w) {
+    int rest = num_segments - w * 64;
+
+    if (rest >= 64)
+        return ~(uint64_t)0;
+
+    return rest <= 0 ? 0 : ((uint64_t)1 << rest) - 1;
+}
+
+/* Set the bits of all num_segments segments, as owned by a seed. */
+static inline void bitfield_fill(vector<uint64_t> &bits, int num_segments) {
+    bits.resize(bitfield_words(num_segments));
+
+    for (int w = 0; w < (int)bits.size(); w++) {
+        bits[w] = bitfield_word_mask(num_segments, w);
+    }
+}
+
+#endif
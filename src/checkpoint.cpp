@@ -0,0 +1,102 @@
+#include "checkpoint.h"
+#include "bitfield.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t checkpoint_size(int num_segments, int hash_size) {
+    return sizeof(checkpoint_header) + bitfield_words(num_segments) * sizeof(uint64_t) +
+           (size_t)num_segments * hash_size;
+}
+
+/* Point the bitmap and the hashes of the state into its mapping. */
+static void locate(checkpoint &state, int num_segments) {
+    state.num_segments = num_segments;
+    state.bits = (uint64_t *)(state.data + sizeof(checkpoint_header));
+    state.hashes = (const char *)(state.bits + bitfield_words(num_segments));
+}
+
+/* Create the checkpoint of a new download at path, with no segment written yet. */
+void create_checkpoint(checkpoint &state, const char *path, int num_segments, int segment_size, const char *hashes,
+                       int hash_size) {
+    state.size = checkpoint_size(num_segments, hash_size);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, state.size) == -1) {
+        perror(path);
+        exit(-1);
+    }
+
+    void *data = mmap(NULL, state.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+
+    state.data = (char *)data;
+    locate(state, num_segments);
+
+    /* the file is zero-filled: the bitmap starts empty */
+    checkpoint_header header = {CHECKPOINT_MAGIC, num_segments, segment_size, hash_size};
+    memcpy((char *)state.hashes, hashes, (size_t)num_segments * hash_size);
+    memcpy(state.data, &header, sizeof(header));
+}
+
+/* Map the checkpoint at path, left by an earlier run. Returns false if there is none, or if it does not
+   match the segment and hash size of this run. */
+bool open_checkpoint(checkpoint &state, const char *path, int segment_size, int hash_size) {
+    checkpoint_header header;
+    struct stat st;
+
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+        return false;
+
+    bool valid = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 header.magic == CHECKPOINT_MAGIC && header.num_segments > 0 &&
+                 header.segment_size == segment_size && header.hash_size == hash_size &&
+                 (size_t)st.st_size == checkpoint_size(header.num_segments, hash_size);
+
+    void *data = valid ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    state.data = (char *)data;
+    state.size = st.st_size;
+    locate(state, header.num_segments);
+
+    /* ignore the bits past the last segment */
+    for (int w = 0; w < bitfield_words(state.num_segments); w++) {
+        state.bits[w] &= bitfield_word_mask(state.num_segments, w);
+    }
+
+    return true;
+}
+
+void close_checkpoint(checkpoint &state) {
+    munmap(state.data, state.size);
+    state.data = NULL;
+}
+
+/* Segments first .. first + count - 1 were written to the output file. */
+void checkpoint_written(checkpoint &state, int first, int count) {
+    for (int s = first; s < first + count; s++) {
+        state.bits[s / 64] |= (uint64_t)1 << (s % 64);
+    }
+}
+
+/* Flush the bitmap to disk, once the output file is synced. Until then the kernel may write the bitmap back
+   before the segments, which is why a resumed download checks the segments it finds against their hash. */
+void sync_checkpoint(checkpoint &state) {
+    if (msync(state.data, state.size, MS_SYNC) == -1)
+        perror("msync");
+}
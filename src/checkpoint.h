@@ -0,0 +1,40 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC 0x4b435442
+
+/* Layout of a checkpoint file: the header, then the bitmap of the segments written to the output file
+   (bitfield_words(num_segments) words), then the hash of every segment (hash_size bytes each). */
+typedef struct {
+    uint32_t magic;
+    int32_t num_segments;
+    int32_t segment_size;
+    int32_t hash_size;
+} checkpoint_header;
+
+/* The resume state of a download, <output file>.state mapped in memory. The bitmap is updated by the
+   disk writer as segments reach the output file; a client restarted with the same output files picks
+   the download up where it stopped. */
+typedef struct {
+    char *data;
+    size_t size;
+    int num_segments;
+    uint64_t *bits;
+    const char *hashes;
+} checkpoint;
+
+void create_checkpoint(checkpoint &state, const char *path, int num_segments, int segment_size, const char *hashes,
+                       int hash_size);
+
+bool open_checkpoint(checkpoint &state, const char *path, int segment_size, int hash_size);
+
+void close_checkpoint(checkpoint &state);
+
+void checkpoint_written(checkpoint &state, int first, int count);
+
+void sync_checkpoint(checkpoint &state);
+
+#endif
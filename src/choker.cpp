@@ -0,0 +1,140 @@
+#include "choker.h"
+
+#include <stdlib.h>
+#include <algorithm>
+
+void init_choker(choker &choke, int numtasks, double rate, unsigned int seed) {
+    choke.received.assign(numtasks, 0);
+    choke.interested.assign(numtasks, -1);
+    choke.sent.assign(numtasks, 0);
+    choke.unchoked.assign(numtasks, false);
+    choke.num_unchoked = 0;
+    choke.optimistic = -1;
+    choke.rounds = 0;
+    choke.next_rechoke = 0;
+    choke.seeding = false;
+    choke.seed = seed;
+    choke.rate = rate;
+    choke.tokens.assign(numtasks, 0);
+    choke.filled.assign(numtasks, -1);
+    choke.candidates.reserve(numtasks);
+    pthread_mutex_init(&choke.lock, NULL);
+}
+
+/* A segment of the given size was received from the peer. */
+void choker_received(choker &choke, int rank, int bytes) {
+    pthread_mutex_lock(&choke.lock);
+    choke.received[rank] += bytes;
+    pthread_mutex_unlock(&choke.lock);
+}
+
+/* The client has nothing left to download: from the next choice on, the peers take turns. */
+void choker_seeding(choker &choke) {
+    pthread_mutex_lock(&choke.lock);
+    choke.seeding = true;
+    pthread_mutex_unlock(&choke.lock);
+}
+
+static void set_unchoked(choker &choke, int rank, bool unchoked) {
+    if (choke.unchoked[rank] != unchoked)
+        choke.num_unchoked += unchoked ? 1 : -1;
+
+    choke.unchoked[rank] = unchoked;
+}
+
+static bool is_interested(choker &choke, int rank, double now) {
+    return choke.interested[rank] >= 0 && now - choke.interested[rank] <= INTERESTED_FOR;
+}
+
+/* Choose the unchoked peers among those that asked for segments lately. */
+static void rechoke(choker &choke, double now) {
+    vector<int> &candidates = choke.candidates;
+
+    candidates.clear();
+    for (int rank = 0; rank < (int)choke.interested.size(); rank++) {
+        if (is_interested(choke, rank, now))
+            candidates.push_back(rank);
+        set_unchoked(choke, rank, false);
+    }
+
+    /* shuffled first, so that equals are taken in a random order */
+    for (int i = (int)candidates.size() - 1; i > 0; i--) {
+        swap(candidates[i], candidates[rand_r(&choke.seed) % (i + 1)]);
+    }
+
+    if (choke.seeding) {
+        stable_sort(candidates.begin(), candidates.end(),
+                    [&](int a, int b) { return choke.sent[a] < choke.sent[b]; });
+    } else {
+        stable_sort(candidates.begin(), candidates.end(),
+                    [&](int a, int b) { return choke.received[a] > choke.received[b]; });
+    }
+
+    int regular = min((int)candidates.size(), UNCHOKE_SLOTS);
+    for (int i = 0; i < regular; i++) {
+        set_unchoked(choke, candidates[i], true);
+    }
+
+    /* the optimistic unchoke stays on its peer for OPTIMISTIC_ROUNDS choices, unless that peer lost
+       interest or earned a regular slot */
+    bool keep = choke.optimistic != -1 && choke.rounds % OPTIMISTIC_ROUNDS != 0 &&
+                is_interested(choke, choke.optimistic, now) && !choke.unchoked[choke.optimistic];
+
+    if (!keep) {
+        int others = candidates.size() - regular;
+        choke.optimistic = others > 0 ? candidates[regular + rand_r(&choke.seed) % others] : -1;
+    }
+
+    if (choke.optimistic != -1)
+        set_unchoked(choke, choke.optimistic, true);
+
+    fill(choke.received.begin(), choke.received.end(), 0);
+
+    choke.rounds++;
+    choke.next_rechoke = now + RECHOKE_INTERVAL;
+}
+
+/* A request for a segment arrived from the peer at time now (seconds): choose the unchoked peers again if
+   it is time to, then unchoke the peer if a slot is free. Returns whether the request is served; the
+   others are answered with REPLY_CHOKED. */
+bool choker_admit(choker &choke, int rank, double now) {
+    pthread_mutex_lock(&choke.lock);
+
+    if (now >= choke.next_rechoke)
+        rechoke(choke, now);
+
+    choke.interested[rank] = now;
+
+    if (!choke.unchoked[rank] && choke.num_unchoked < UNCHOKE_SLOTS + 1)
+        set_unchoked(choke, rank, true);
+
+    bool admitted = choke.unchoked[rank];
+
+    pthread_mutex_unlock(&choke.lock);
+    return admitted;
+}
+
+/* bytes were sent to the peer at time now: returns how many seconds its next segment has to wait, so that
+   the peer is sent at most choke.rate bytes per second, in bursts of up to a segment. */
+double choker_shape(choker &choke, int rank, int bytes, double now) {
+    double wait = 0;
+
+    pthread_mutex_lock(&choke.lock);
+
+    choke.sent[rank] += bytes;
+
+    if (choke.rate > 0) {
+        double &tokens = choke.tokens[rank];
+
+        tokens = choke.filled[rank] < 0 ? bytes : min(tokens + (now - choke.filled[rank]) * choke.rate, (double)bytes);
+        choke.filled[rank] = now;
+        tokens -= bytes;
+
+        /* the bucket goes into debt, the wait pays it back */
+        if (tokens < 0)
+            wait = -tokens / choke.rate;
+    }
+
+    pthread_mutex_unlock(&choke.lock);
+    return wait;
+}
@@ -0,0 +1,59 @@
+#ifndef __CHOKER_H__
+#define __CHOKER_H__
+
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+/* peers unchoked for what they upload to this client, plus one optimistic unchoke */
+#define UNCHOKE_SLOTS 4
+/* seconds between two choices of the unchoked peers */
+#define RECHOKE_INTERVAL 0.05
+/* seconds a peer counts as interested after its last request: a choked peer only asks again with its next
+   peer list, so it must still be a candidate, and keep a slot it got, by then */
+#define INTERESTED_FOR 1.0
+/* the optimistic unchoke moves on every this many choices */
+#define OPTIMISTIC_ROUNDS 3
+/* the tail of the empty reply to a choked peer, in place of the number of requests queued */
+#define REPLY_CHOKED -2
+
+/* The upload slots of a client (-k): requests are only served for the unchoked peers. While the client
+   downloads, it unchokes the peers it received the most from since the last choice (tit-for-tat); once
+   its downloads are complete, it unchokes the peers it sent the least to, so they take turns. One more peer is
+   unchoked at random, so newcomers get something to reciprocate with. The segments sent to each peer can
+   also be shaped with a token bucket (-b): past its rate, the peer's requests are deferred in the upload
+   queue. Shared by the download thread, which reports what it receives, and the upload threads. */
+typedef struct {
+    /* per rank: bytes received since the last choice, when it last asked for a segment (-1 never), bytes sent */
+    vector<long> received;
+    vector<double> interested;
+    vector<long> sent;
+    vector<bool> unchoked;
+    int num_unchoked;
+    int optimistic;
+    int rounds;
+    double next_rechoke;
+    /* every download of the client is complete */
+    bool seeding;
+    unsigned int seed;
+    /* bytes per second each peer may be sent, 0 for no limit; its bucket, filled up to when */
+    double rate;
+    vector<double> tokens;
+    vector<double> filled;
+    /* scratch for the candidates of a choice */
+    vector<int> candidates;
+    pthread_mutex_t lock;
+} choker;
+
+void init_choker(choker &choke, int numtasks, double rate, unsigned int seed);
+
+void choker_received(choker &choke, int rank, int bytes);
+
+void choker_seeding(choker &choke);
+
+bool choker_admit(choker &choke, int rank, double now);
+
+double choker_shape(choker &choke, int rank, int bytes, double now);
+
+#endif
@@ -0,0 +1,116 @@
+#include "disk_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+
+void init_disk_writer(disk_writer &writer, int capacity) {
+    writer.pending.clear();
+    writer.pending.reserve(capacity);
+    writer.batch.clear();
+    writer.batch.reserve(capacity);
+    writer.closed = false;
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.not_empty, NULL);
+}
+
+static void push_request(disk_writer &writer, segment_store *store, int segment) {
+    pthread_mutex_lock(&writer.lock);
+
+    writer.pending.push_back({store, segment});
+
+    pthread_cond_signal(&writer.not_empty);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/* Write the segment, already in the store, to its place in the output file. */
+void writer_push(disk_writer &writer, segment_store *store, int segment) {
+    push_request(writer, store, segment);
+}
+
+/* Every segment of the store was pushed: flush the output file to disk once they are written. */
+void writer_finish(disk_writer &writer, segment_store *store) {
+    push_request(writer, store, WRITE_FINISH);
+}
+
+/* No more requests will be pushed: the writer stops once it wrote the pending ones. */
+void close_disk_writer(disk_writer &writer) {
+    pthread_mutex_lock(&writer.lock);
+
+    writer.closed = true;
+    pthread_cond_broadcast(&writer.not_empty);
+
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/* Batch order: by store, its segments by offset and the finish last, after the segments it waits for. */
+static bool write_before(const write_request &a, const write_request &b) {
+    if (a.store != b.store)
+        return a.store < b.store;
+
+    unsigned int sa = a.segment, sb = b.segment;
+    return sa < sb;
+}
+
+static void write_run(segment_store *store, int first, int count) {
+    size_t offset = (size_t)first * store->segment_size;
+    size_t size = (size_t)count * store->segment_size;
+
+    for (size_t done = 0; done < size; ) {
+        ssize_t w = pwrite(store->fd, store->data + offset + done, size - done, offset + done);
+        if (w <= 0) {
+            perror("pwrite");
+            exit(-1);
+        }
+        done += w;
+    }
+
+    if (store->state.data)
+        checkpoint_written(store->state, first, count);
+}
+
+/* Body of the writer thread, arg is the disk_writer. */
+void *disk_writer_func(void *arg) {
+    disk_writer &writer = *(disk_writer *)arg;
+    vector<write_request> &batch = writer.batch;
+
+    while (true) {
+        pthread_mutex_lock(&writer.lock);
+
+        while (writer.pending.empty() && !writer.closed)
+            pthread_cond_wait(&writer.not_empty, &writer.lock);
+
+        if (writer.pending.empty()) {
+            pthread_mutex_unlock(&writer.lock);
+            break;
+        }
+
+        batch.clear();
+        batch.swap(writer.pending);
+
+        pthread_mutex_unlock(&writer.lock);
+
+        sort(batch.begin(), batch.end(), write_before);
+
+        for (size_t i = 0; i < batch.size(); ) {
+            write_request &first = batch[i];
+
+            if (first.segment == WRITE_FINISH) {
+                finish_output_store(*first.store);
+                i++;
+                continue;
+            }
+
+            /* extend the run while the next request is the next segment of the same file */
+            size_t j = i + 1;
+            while (j < batch.size() && batch[j].store == first.store && batch[j].segment == batch[j - 1].segment + 1)
+                j++;
+
+            write_run(first.store, first.segment, j - i);
+            i = j;
+        }
+    }
+
+    return NULL;
+}
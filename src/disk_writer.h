@@ -0,0 +1,44 @@
+#ifndef __DISK_WRITER_H__
+#define __DISK_WRITER_H__
+
+#include <pthread.h>
+#include <vector>
+
+#include "segment_store.h"
+
+using namespace std;
+
+/* A verified segment to write to its output file, or, with segment == WRITE_FINISH, the file is complete. */
+typedef struct {
+    segment_store *store;
+    int segment;
+} write_request;
+
+#define WRITE_FINISH -1
+
+/* requests the writer may fall behind by before the download thread has to grow the queue */
+#define WRITER_BACKLOG 4096
+
+/* Writes the downloaded segments to their output files on a thread of its own, so the download thread
+   never waits on the disk. The requests are taken in batches: the segments of a batch are written in
+   file order, each run of adjacent segments with one pwrite, and a complete file gets one fsync. */
+typedef struct {
+    /* filled by the download thread, swapped with batch by the writer; both keep their capacity */
+    vector<write_request> pending;
+    vector<write_request> batch;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} disk_writer;
+
+void init_disk_writer(disk_writer &writer, int capacity);
+
+void writer_push(disk_writer &writer, segment_store *store, int segment);
+
+void writer_finish(disk_writer &writer, segment_store *store);
+
+void close_disk_writer(disk_writer &writer);
+
+void *disk_writer_func(void *arg);
+
+#endif
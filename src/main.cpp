@@ -1,241 +1,1029 @@
 #include "utils.h"
 
 /* tracker data */
-/* tracker_map[filename][rank] = a vector of elements containing {segment_number, segment_hash}
-for each segment owned by client with given rank */
-map<string, map<int, vector<segment_info>>> tracker_map;
+/* swarms.files[file_id] = the segment hashes of the file and, for each peer in its swarm,
+a bitset of the segments owned by the peer */
+tracker_index swarms;
 
 /* client data */
-map<string, int> num_segments;
-map<string, int> missing_segments;
-map<int, int> peer_requests;
+/* files[id] = the state of each owned or wanted file, interned in the order of the input:
+file_ids[filename] = id; the table does not change once the input is read */
+vector<client_file> files;
+map<string, int> file_ids;
+
+/* load.peers[rank] = the requests sent to each peer, its round trip and how busy it is */
+peer_stats load;
+
+/* the message buffers of the download thread */
+client_scratch scratch;
+
+/* maximum number of segment requests a client keeps in flight */
+int download_window = DOWNLOAD_WINDOW;
+
+/* the hashes the files point to: the client's binary input, mapped in memory, or segment_hashes[filename]
+for the files of a text input and the downloaded files, HASH_SIZE bytes per segment */
+manifest input_manifest;
+map<string, vector<char>> segment_hashes;
+
+/* stores[filename] = the contents of each owned or downloaded file; the map itself is shared by
+the download and upload threads and guarded by stores_lock, the segments are not */
+map<string, segment_store> stores;
+pthread_mutex_t stores_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ranks 0 .. num_trackers - 1 are tracker shards, each owning the files that tracker_of maps to it */
+int num_trackers = 1;
+
+/* timings and counters of this rank, written to the run report given with -j */
+run_stats stats;
+const char *report_path = NULL;
+
+/* prefix of the metrics files given with -m (builds with METRICS only) */
+const char *metrics_prefix = NULL;
+
+/* with -r, segments are fetched with MPI_Get from the stores the clients attach to store_window, without
+involving the uploader */
+bool rma_fetch = false;
+MPI_Win store_window = MPI_WIN_NULL;
+
+/* with -l, the clients of a node keep their stores in one shared memory window and copy segments from
+each other's stores */
+bool shared_stores = false;
+node_share node;
+
+/* writes the downloaded segments to the output files, on a thread of its own */
+disk_writer writer;
+
+/* with -u, every segment upload is delayed by this many microseconds, to benchmark slow peers */
+int upload_delay = 0;
+
+/* with -k, the client only serves the peers it unchokes (see choker); with -b, each peer is sent at most
+upload_rate bytes per second */
+bool choke_uploads = false;
+double upload_rate = 0;
+choker upload_slots;
+
+/* size in bytes of every segment, and the directory holding the data of seeded files */
+int segment_size = SEGMENT_SIZE;
+const char *data_dir = ".";
+
+/* Let the other clients read the store with MPI_Get (-r). */
+void expose_store(segment_store &store) {
+    if (rma_fetch)
+        MPI_Win_attach(store_window, store.data, store.size > 0 ? store.size : 1);
+}
+
+/* Collect at each tracker shard the manifest every client has for it, with one gather per shard that all
+   the ranks take part in (mine[shard] is empty on the trackers). The lengths are gathered first, so the
+   shard receives every manifest straight into its place: on the shard, gathered holds the manifest of
+   rank r at offsets[r], lengths[r] bytes long. */
+void gather_manifests(vector<vector<char>> &mine, vector<char> &gathered, vector<int> &offsets, vector<int> &lengths, int rank, int numtasks) {
+    for (int shard = 0; shard < num_trackers; shard++) {
+        int length = mine[shard].size();
+        bool root = rank == shard;
+
+        lengths.resize(root ? numtasks : 0);
+        MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, shard, MPI_COMM_WORLD);
+
+        if (root) {
+            offsets.assign(numtasks, 0);
+            for (int r = 1; r < numtasks; r++) {
+                offsets[r] = offsets[r - 1] + lengths[r - 1];
+            }
+            gathered.resize(offsets[numtasks - 1] + lengths[numtasks - 1]);
+        }
 
-/* files[filename][segment_number] = element of type {hash, owned} for each segment of the file */
-map<string, map<int, seg_info>> files;
+        MPI_Gatherv(mine[shard].data(), length, MPI_CHAR, gathered.data(), lengths.data(), offsets.data(), MPI_CHAR,
+                    shard, MPI_COMM_WORLD);
+    }
+}
 
 void init_tracker(int numtasks, int rank) {
-    char data[MAX_MESSAGE_LEN];
-    MPI_Status status;
+    vector<vector<char>> none(num_trackers);
+    vector<char> gathered;
+    vector<int> offsets, lengths;
 
-    /* Wait for initial message from each client, containing the list of owned files. */
-    for (int i = 0; i < numtasks - 1; i++) {
-        MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
+    /* Get the initial message of every client, containing the list of owned files of this shard. */
+    gather_manifests(none, gathered, offsets, lengths, rank, numtasks);
 
-        add_files_to_map(data, status.MPI_SOURCE, tracker_map);
+    for (int r = num_trackers; r < numtasks; r++) {
+        add_files_to_index(gathered.data() + offsets[r], r, swarms);
     }
 
-    /* Send ACK to each client */
-    memset(data, 0, sizeof(data));
-    strncpy(data, "ACK", 4);
-    for (int i = 1; i < numtasks; i++) {
-        MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, i, TAG_ACK, MPI_COMM_WORLD);
+    /* the clients start once every shard has indexed its files */
+    MPI_Barrier(MPI_COMM_WORLD);
+    stats.ready = MPI_Wtime();
+}
+
+/* Handle the messages queued by the tracker's event loop: build and send peer lists, apply updates. */
+void *tracker_worker_func(void *arg) {
+    work_queue &queue = *(work_queue *) arg;
+    work_item item;
+    vector<char> data;
+    send_pool replies;
+
+    while (queue_pop(queue, item)) {
+        if (item.tag == TAG_REQUEST) {
+            send_peer_list(item.data.data(), item.source, swarms, data, replies);
+            METRIC_LATENCY(LATENCY_TRACKER_REQUEST, item.received);
+
+        } else if (item.tag == TAG_UPDATE) {
+            parse_update(item.data.data(), item.source, swarms);
+            METRIC_LATENCY(LATENCY_TRACKER_UPDATE, item.received);
+        }
     }
+
+    pool_wait(replies);
+
+    return NULL;
 }
 
 void tracker(int numtasks, int rank) {
     init_tracker(numtasks, rank);
 
-    char data[MAX_MESSAGE_LEN];
-    MPI_Status status;
+    /* the event loop keeps TRACKER_RECEIVES receives posted and hands every message to the workers,
+       so a slow client or a long peer list never holds up the other messages */
+    vector<vector<char>> buffers(TRACKER_RECEIVES, vector<char>(TRACKER_MESSAGE_SIZE));
+    vector<MPI_Request> requests(TRACKER_RECEIVES);
+    vector<MPI_Status> statuses(TRACKER_RECEIVES);
+    vector<int> completed(TRACKER_RECEIVES);
+    int num_completed;
 
-    /* run until all clients have finished downloading their desired files */
+    for (int i = 0; i < TRACKER_RECEIVES; i++) {
+        MPI_Irecv(buffers[i].data(), TRACKER_MESSAGE_SIZE, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &requests[i]);
+    }
+
+    work_queue queue;
+    init_queue(queue);
+
+    pthread_t workers[TRACKER_WORKERS];
+    for (int i = 0; i < TRACKER_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, tracker_worker_func, (void *) &queue)) {
+            printf("Eroare la crearea thread-ului de tracker\n");
+            exit(-1);
+        }
+    }
+
+    /* run until all clients have finished downloading their desired files; every client sends its FIN
+       to every shard, so each shard knows on its own when the swarm is done */
     int finished = 0;
+    work_item item;
+
+    while (finished < numtasks - num_trackers) {
+        MPI_Waitsome(TRACKER_RECEIVES, requests.data(), &num_completed, completed.data(), statuses.data());
+
+        for (int c = 0; c < num_completed; c++) {
+            int i = completed[c];
+            int len;
+            MPI_Get_count(&statuses[c], MPI_CHAR, &len);
+            METRIC_RECEIVED(statuses[c].MPI_TAG, len);
+            stats.tracker_messages++;
 
-    while (finished < numtasks - 1) {
-        MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            if (statuses[c].MPI_TAG == TAG_FIN) {
+                finished++;
 
-        if (status.MPI_TAG == TAG_FIN) {
-            finished++;
+            } else if (statuses[c].MPI_TAG == TAG_REQUEST || statuses[c].MPI_TAG == TAG_UPDATE) {
+                item.source = statuses[c].MPI_SOURCE;
+                item.tag = statuses[c].MPI_TAG;
+                item.data.assign(buffers[i].data(), buffers[i].data() + len);
+                METRIC_STAMP(item.received);
 
-        } else if (status.MPI_TAG == TAG_REQUEST) {
-            send_peer_list(data, status.MPI_SOURCE, tracker_map);
+                queue_push(queue, item);
+            }
 
-        } else if (status.MPI_TAG == TAG_UPDATE) {
-            parse_update(data, status.MPI_SOURCE, tracker_map);
+            MPI_Irecv(buffers[i].data(), TRACKER_MESSAGE_SIZE, MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &requests[i]);
         }
     }
 
-    /* send FIN to each client so they can stop */
-    memset(data, 0, sizeof(data));
-    strncpy(data, "FIN", 4);
-    for (int i = 1; i < numtasks; i++) {
-        MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, i, TAG_REQUEST, MPI_COMM_WORLD);
+    /* nothing is left to receive, the workers stop once they have handled and sent everything */
+    for (int i = 0; i < TRACKER_RECEIVES; i++) {
+        MPI_Cancel(&requests[i]);
+        MPI_Wait(&requests[i], MPI_STATUS_IGNORE);
+    }
+
+    close_queue(queue);
+
+    for (int i = 0; i < TRACKER_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    /* the first shard sends FIN to each client so they can stop */
+    if (rank != TRACKER_RANK)
+        return;
+
+    for (int i = num_trackers; i < numtasks; i++) {
+        send_message("FIN", 4, i, TAG_REQUEST);
+    }
+}
+
+/* Move the stores to memory shared with the clients on this node (-l). The sizes of the wanted files are
+   learned from a first exchange with the tracker shards, so that the shared window can be allocated at
+   once, collectively with the other clients of the node. */
+void share_stores(int rank) {
+    vector<char> data;
+    MPI_Status status;
+
+    int num_requests = send_request_to_tracker(files, scratch, num_trackers);
+    for (int i = 0; i < num_requests; i++) {
+        recv_message(data, MPI_ANY_SOURCE, TAG_PEER_LIST, &status);
+        parse_list_from_tracker(data.data(), rank, load.peers.size(), files, file_ids, segment_hashes, scratch);
+    }
+
+    map<string, size_t> sizes;
+    map<string, char *> placed;
+    for (client_file &file: files) {
+        if (file.store)
+            sizes[file.name] = file.store->size;
+        else if (file.downloading)
+            sizes[file.name] = (size_t)file.picker.num_segments * segment_size;
     }
+
+    allocate_node_share(node, sizes, placed);
+
+    for (client_file &file: files) {
+        auto it = placed.find(file.name);
+        if (it == placed.end())
+            continue;
+
+        file.shared = it->second;
+        if (file.store)
+            move_seed_store(*file.store, file.shared);
+    }
+
+    /* the other clients of the node hash the seeds straight from the window, not before they are in */
+    MPI_Barrier(node.comm);
 }
 
-void init_client(int rank) {
-    char input_filename[MAX_FILENAME+1];
+/* Give the file an id in the file table. */
+client_file &intern_file(const char *filename) {
+    file_ids[filename] = files.size();
+    files.emplace_back();
+
+    client_file &file = files.back();
+    file.name = filename;
+    file.num_segments = 0;
+    file.missing = 0;
+    file.hashes = NULL;
+    file.view = {0, 0};
+    file.shard = tracker_of(filename, num_trackers);
+    file.downloading = false;
+    file.store = NULL;
+    file.shared = NULL;
+
+    return file;
+}
+
+/* Add a seeded file: its hashes (total_segments * HASH_SIZE bytes, which must outlive the client) are added to
+   the manifest of its tracker shard and the file points to them, its data is mapped. */
+void add_seeded_file(const char *filename, int total_segments, const char *hashes, vector<vector<char>> &manifests,
+                     vector<int> &manifest_files) {
+    char data_filename[PATH_MAX];
+
+    client_file &file = intern_file(filename);
+    file.num_segments = total_segments;
+    file.hashes = hashes;
+    bitfield_fill(file.owned, total_segments);
+
+    put_manifest_file(manifests[file.shard], filename, total_segments, hashes);
+    manifest_files[file.shard]++;
+
+    /* map the data of the file, segments missing from the data directory are generated from their hash */
+    snprintf(data_filename, sizeof(data_filename), "%s/%s", data_dir, filename);
+
+    segment_store &store = stores[filename];
+    int on_disk = open_seed_store(store, data_filename, total_segments, segment_size);
+    file.store = &store;
+
+    for (int j = on_disk; j < total_segments; j++) {
+        fill_synthetic_segment(segment_data(store, j), hashes + (size_t)j * HASH_SIZE, HASH_SIZE, segment_size);
+    }
+}
+
+void add_wanted_file(const char *filename) {
+    intern_file(filename);
+}
+
+/* Read the text input of the client: the owned files, each with its segment hashes, then the wanted files.
+   The hashes are kept in segment_hashes. */
+void read_text_input(const char *path, vector<vector<char>> &manifests, vector<int> &manifest_files) {
     char filename[MAX_FILENAME+1] = {0};
     char hash[HASH_SIZE+1] = {0};
-    char data[MAX_MESSAGE_LEN] = {0};
 
-    sprintf(input_filename, "in%d.txt", rank);
+    /* the words are read at most MAX_FILENAME and HASH_SIZE characters long */
+    char name_format[16], hash_format[16];
+    snprintf(name_format, sizeof(name_format), "%%%ds", MAX_FILENAME);
+    snprintf(hash_format, sizeof(hash_format), "%%%ds", HASH_SIZE);
 
-    FILE *fp = fopen(input_filename, "r");
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(-1);
+    }
 
     /* read the list of owned files and their segments */
-    int num_files, total_segments;
+    int num_files = 0, total_segments = 0;
     fscanf(fp, "%d", &num_files);
 
-    strncpy(data, (char *)(&num_files), sizeof(int));
-    int offset = sizeof(int);
+    for (int i = 0; i < num_files; i++) {
+        fscanf(fp, name_format, filename);
+        fscanf(fp, "%d", &total_segments);
 
-    seg_info segment_info;
+        vector<char> &hashes = segment_hashes[filename];
+        hashes.assign((size_t)max(total_segments, 0) * HASH_SIZE, 0);
 
-    for (int i = 0; i < num_files; i++) {
-        fscanf(fp, "%s %d", filename, &total_segments);
+        for (int j = 0; j < total_segments; j++) {
+            fscanf(fp, hash_format, hash);
+            memcpy(&hashes[(size_t)j * HASH_SIZE], hash, HASH_SIZE);
+        }
 
-        strncpy(data + offset, filename, MAX_FILENAME+1);
-        offset += MAX_FILENAME+1;
+        add_seeded_file(filename, max(total_segments, 0), hashes.data(), manifests, manifest_files);
+    }
 
-        strncpy(data + offset, (char *)&total_segments, sizeof(int));
-        offset += sizeof(int);
+    /* read the list of wanted files */
+    int num_wanted = 0;
+    fscanf(fp, "%d", &num_wanted);
 
-        num_segments[filename] = total_segments;
-        missing_segments[filename] = 0;
+    for (int i = 0; i < num_wanted; i++) {
+        fscanf(fp, name_format, filename);
+        add_wanted_file(filename);
+    }
 
-        for (int j = 0; j < total_segments; j++) {
-            fscanf(fp, "%s", hash);
+    fclose(fp);
+}
 
-            strncpy(data + offset, hash, HASH_SIZE+1);
-            offset += HASH_SIZE+1;
+/* Read the binary input of the client, mapped in memory: the files point to the hashes in place. */
+void read_binary_input(manifest &input, vector<vector<char>> &manifests, vector<int> &manifest_files) {
+    for (int i = 0; i < input.num_files; i++) {
+        add_seeded_file(input.files[i].name, input.files[i].num_segments, manifest_hashes(input, i), manifests,
+                        manifest_files);
+    }
 
-            strncpy(segment_info.hash, hash, HASH_SIZE+1);
-            segment_info.owned = true;
+    for (int i = 0; i < input.num_wanted; i++) {
+        add_wanted_file(input.wanted[i]);
+    }
+}
 
-            files[filename][j] = segment_info;
+/* Pick up the download of a newly discovered file where an earlier run stopped, from the checkpoint next
+   to its output file. The checkpoint is only trusted if it holds the segment hashes of the swarm, which the
+   first peer list brought: the input of the swarm may have changed since. The segments it marks as written
+   are owned if the output file holds them intact, and reach the tracker with the next update. Returns the
+   number of segments owned, or -1 if nothing was resumed and the output file is to be created anew. */
+int resume_download(client_file &file, const char *output_filename, const char *state_filename) {
+    checkpoint state;
+    if (!open_checkpoint(state, state_filename, segment_size, HASH_SIZE))
+        return -1;
+
+    int num_segments = file.num_segments;
+    if (state.num_segments != num_segments || memcmp(state.hashes, file.hashes, (size_t)num_segments * HASH_SIZE)) {
+        close_checkpoint(state);
+        return -1;
+    }
+
+    segment_store store;
+    if (!resume_output_store(store, output_filename, num_segments, segment_size)) {
+        close_checkpoint(state);
+        return -1;
+    }
+    store.state = state;
+
+    vector<char> scratch_segment(segment_size);
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int num_owned = 0;
+
+    /* a segment marked as written may not have reached the disk before the run stopped */
+    for (int s = 0; s < num_segments; s++) {
+        uint64_t mask = (uint64_t)1 << (s % 64);
+        if (!(state.bits[s / 64] & mask))
+            continue;
+
+        const char *hash = file.hashes + (size_t)s * HASH_SIZE;
+        sha256((const unsigned char *)segment_data(store, s), segment_size, digest);
+
+        if (verify_segment(segment_data(store, s), segment_size, digest, hash, scratch_segment)) {
+            bitfield_set(file.owned, s);
+            bitfield_set(file.updated, s);
+            store_segment_held(store, s);
+            picker_segment_done(file.picker, s);
+            num_owned++;
+        } else {
+            state.bits[s / 64] &= ~mask;
         }
     }
 
-    /* read the list of wanted files */
-    int num_wanted;
-    fscanf(fp, "%d", &num_wanted);
+    if (file.shared)
+        move_seed_store(store, file.shared);
 
-    for (int i = 0; i < num_wanted; i++) {
-        map<int, seg_info> emptyMap;
-        fscanf(fp, "%s", filename);
+    pthread_mutex_lock(&stores_lock);
+    stores[file.name] = store;
+    file.store = &stores[file.name];
+    expose_store(*file.store);
+    pthread_mutex_unlock(&stores_lock);
+
+    file.missing -= num_owned;
+
+    return num_owned;
+}
+
+void init_client(int numtasks, int rank) {
+    char input_filename[PATH_MAX];
 
-        num_segments[filename] = 0;
-        missing_segments[filename] = 0;
+    /* one manifest per tracker shard, each starting with the number of files it lists */
+    vector<vector<char>> manifests(num_trackers);
+    vector<int> manifest_files(num_trackers, 0);
 
-        files[filename] = emptyMap;
+    for (vector<char> &manifest: manifests) {
+        put_int(manifest, 0);
     }
 
-    fclose(fp);
+    /* the binary input in<id>.bin is used if there is one, otherwise the text input in<id>.txt */
+    snprintf(input_filename, sizeof(input_filename), "in%d.bin", client_id(rank, num_trackers));
+
+    if (open_manifest(input_manifest, input_filename, HASH_SIZE, MAX_FILENAME)) {
+        read_binary_input(input_manifest, manifests, manifest_files);
+    } else {
+        snprintf(input_filename, sizeof(input_filename), "in%d.txt", client_id(rank, num_trackers));
+        read_text_input(input_filename, manifests, manifest_files);
+    }
+
+    /* Send the file list to the tracker shards, every shard gets a (possibly empty) manifest */
+    for (int shard = 0; shard < num_trackers; shard++) {
+        memcpy(manifests[shard].data(), &manifest_files[shard], sizeof(int));
+    }
+
+    vector<char> gathered;
+    vector<int> offsets, lengths;
+    gather_manifests(manifests, gathered, offsets, lengths, rank, numtasks);
 
-    /* Send the file list to the tracker */
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, 0, MPI_COMM_WORLD);
+    /* wait until every shard has indexed the manifests */
+    MPI_Barrier(MPI_COMM_WORLD);
+    stats.ready = MPI_Wtime();
 
-    /* Wait for ACK from the tracker */
+    init_peer_stats(load, numtasks);
+    init_choker(upload_slots, numtasks, upload_rate, rank);
+    init_client_scratch(scratch, num_trackers, numtasks);
+
+    for (client_file &file: files) {
+        if (rma_fetch)
+            file.remote.assign(numtasks, 0);
+
+        if (shared_stores) {
+            file.node_files.assign(numtasks, NULL);
+            file.node_known.assign(numtasks, false);
+        }
+    }
+
+    if (shared_stores)
+        share_stores(rank);
+
+    /* the stores are in their final place now */
+    for (auto &[filename, store]: stores) {
+        expose_store(store);
+    }
+}
+
+/* Pick the next segment to request, going through the files in order, and a peer who has it.
+   Returns false if none of the missing segments is available in the current peer list. */
+bool next_segment(int &file, int &segment, int &peer_rank) {
+    for (int id = 0; id < (int)files.size(); id++) {
+        if (!files[id].downloading || files[id].missing == 0)
+            continue;
+
+        piece_picker &picker = files[id].picker;
+        /* a segment and a peer who has it and does not choke the client */
+        segment = pick_request(picker, load, node.local, peer_rank);
+        if (segment == -1)
+            continue;
+
+        file = id;
+        return true;
+    }
+
+    return false;
+}
+
+/* With -l, take the segment straight from the store of the peer if it is on this node: it is hashed there
+   and copied once, to the output file. Returns false if the peer does not share the file. */
+bool take_from_node(download_slot &slot) {
+    client_file &file = files[slot.file];
+    if (file.node_known.empty())
+        return false;
+
+    if (!file.node_known[slot.peer]) {
+        file.node_files[slot.peer] = peer_shared_file(node, slot.peer, file.name.c_str());
+        file.node_known[slot.peer] = true;
+    }
+
+    char *shared = file.node_files[slot.peer];
+    if (!shared)
+        return false;
+
+    slot.source = shared + (size_t)slot.segment * segment_size;
+    slot.received = segment_size;
+
+    return true;
+}
+
+/* Start the transfer of the segment of slot i. The segment is requested from the peer, which replies with
+   it on the slot's tag; with -r it is read from the peer's store with MPI_Get instead, after asking the
+   peer once where its store of the file is. */
+void start_transfer(download_slot &slot, int i, MPI_Request *request) {
+    client_file &file = files[slot.file];
+    slot.busy = true;
+    slot.source = slot.buffer.data();
+    slot.requested = MPI_Wtime();
+    peer_request_sent(load, slot.peer);
+    slot.locating = rma_fetch && file.remote[slot.peer] == 0;
+
+    if (rma_fetch && !slot.locating) {
+        MPI_Aint address = MPI_Aint_add(file.remote[slot.peer], (MPI_Aint)slot.segment * segment_size);
+        MPI_Rget(slot.buffer.data(), segment_size, MPI_CHAR, slot.peer, address, segment_size, MPI_CHAR,
+                 store_window, request);
+        return;
+    }
+
+    /* send request, the peer replies with the segment (or the address of its store) on the slot's tag */
+    send_file_request(file.name.c_str(), file.hashes + (size_t)slot.segment * HASH_SIZE,
+                      slot.locating ? LOCATE_SEGMENT : slot.segment, slot.peer, TAG_SEGMENT_BASE + i,
+                      slot.request, &slot.send_request);
+
+    /* the segment is received in the slot and copied to the output file once verified, so that
+       a duplicate request in the endgame never writes over a valid copy */
+    MPI_Irecv(slot.buffer.data(), slot.buffer.size(), MPI_CHAR, slot.peer, TAG_SEGMENT_BASE + i,
+              MPI_COMM_WORLD, request);
+}
+
+/* Record the HAVE messages that arrived from the peers since the last call. */
+void receive_haves(vector<char> &data) {
     MPI_Status status;
-    MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_ACK, MPI_COMM_WORLD, &status);
+
+    while (try_recv_message(data, MPI_ANY_SOURCE, TAG_HAVE, &status)) {
+        parse_haves(data.data(), status.MPI_SOURCE, files, file_ids);
+    }
 }
 
 void *download_thread_func(void *arg)
 {
     int rank = *(int*) arg;
 
-    int segment;
-    char data[MAX_MESSAGE_LEN+1];
-    char update[MAX_MESSAGE_LEN+1];
+    vector<char> data;
+
+    /* segments received since the last HAVE to the peers, as {file, segment} */
+    vector<pair<int, int>> fresh;
+    fresh.reserve(HAVE_BATCH);
+    send_pool haves;
 
-    int needed_segments = 0, total_segments;
+    int needed_segments = 0, updated_segments;
     MPI_Status status;
 
+    /* outstanding segment requests, the reply for slot i is received with tag TAG_SEGMENT_BASE + i */
+    vector<download_slot> slots(download_window);
+    vector<MPI_Request> recv_requests(download_window, MPI_REQUEST_NULL);
+    for (download_slot &slot: slots) {
+        slot.busy = false;
+        slot.send_request = MPI_REQUEST_NULL;
+        slot.buffer.resize(max(segment_size + (int)sizeof(int), (int)sizeof(MPI_Aint)));
+    }
+    vector<int> completed(download_window);
+    vector<MPI_Status> statuses(download_window);
+    int in_flight = 0, num_completed;
+
+    /* received segments waiting to be verified, hashed hash_lanes at a time */
+    int hash_lanes = sha256_best_lanes();
+    vector<int> received;
+    received.reserve(download_window);
+    vector<const unsigned char *> payloads(download_window);
+    vector<unsigned char> digest_data(download_window * SHA256_DIGEST_SIZE);
+    unsigned char (*digests)[SHA256_DIGEST_SIZE] = (unsigned char (*)[SHA256_DIGEST_SIZE])digest_data.data();
+    vector<char> scratch_segment(segment_size);
+
+    /* the fetches with MPI_Get (-r) all happen in one passive target epoch on every client */
+    if (rma_fetch)
+        MPI_Win_lock_all(0, store_window);
+
+    int round = 0;
+
     do {
-        /* send request to the tracker */
-        send_request_to_tracker(files, num_segments, missing_segments);
+        /* the first round discovers the files and sizes the buffers, the ones after it should not allocate */
+        if (round++ == 1)
+            METRIC_COUNT_ALLOCATIONS(true);
 
-        /* receive list with seeds/peers from the tracker */
-        MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_PEER_LIST, MPI_COMM_WORLD, &status);
+        /* the peers that choked the client are asked again with the new peer lists */
+        forget_chokes(load);
 
-        map<string, map<int, list<int>>> mp;
-        parse_list_from_tracker(mp, data, files);
+        /* send request to the tracker shards that own the wanted files */
+        int num_requests = send_request_to_tracker(files, scratch, num_trackers);
 
+        /* receive list with seeds/peers from each of them */
+        for (int i = 0; i < num_requests; i++) {
+            METRIC_TIMER(waiting);
+            recv_message(data, MPI_ANY_SOURCE, TAG_PEER_LIST, &status);
+            METRIC_LATENCY(LATENCY_PEER_LIST_WAIT, waiting);
+
+            parse_list_from_tracker(data.data(), rank, load.peers.size(), files, file_ids, segment_hashes, scratch);
+        }
 
         /* update the number of missing segments */
-        update_missing_segments(mp, num_segments, missing_segments, &needed_segments);
-
-        total_segments = min(needed_segments, 10);
-
-        memset(update, 0, sizeof(update));
-        strncpy(update, (char *)&total_segments, sizeof(int));
-        int offset = sizeof(int);
-
-        /* send requests to get segments from peers */
-        for (int i = 0; i < total_segments; i++) {
-            /* get missing segment */
-            for (auto &[filename, m]: files) {
-                if (missing_segments[filename] > 0) {
-                    for (int s = 0; s < num_segments[filename]; s++) {
-                        if (files[filename][s].owned == false) {
-                            segment = s;
-                            break;
-                        }
-                    }
+        update_missing_segments(files, &needed_segments);
 
-                    /* find a peer who has the segment */
-                    int peer_rank = find_peer(mp, filename, segment, peer_requests);
+        /* resume or create the output file of each newly discovered file */
+        for (client_file &file: files) {
+            if (!file.downloading || file.store)
+                continue;
 
-                    /* send request */
-                    send_file_request(filename.c_str(), files[filename][segment].hash, peer_rank);
+            char output_filename[PATH_MAX];
+            snprintf(output_filename, sizeof(output_filename), "client%d_%s", client_id(rank, num_trackers), file.name.c_str());
+
+            char state_filename[PATH_MAX + 8];
+            snprintf(state_filename, sizeof(state_filename), "%s.state", output_filename);
+
+            int resumed = resume_download(file, output_filename, state_filename);
+            if (resumed >= 0) {
+                needed_segments -= resumed;
+
+                if (file.missing == 0) {
+                    send_file_downloaded(file.name.c_str(), num_trackers, data);
+                    writer_finish(writer, file.store);
+                }
+                continue;
+            }
+
+            pthread_mutex_lock(&stores_lock);
+            segment_store &store = stores[file.name];
+            if (file.shared)
+                create_shared_output_store(store, file.shared, output_filename, file.num_segments, segment_size);
+            else
+                create_output_store(store, output_filename, file.num_segments, segment_size);
+            create_checkpoint(store.state, state_filename, file.num_segments, segment_size, file.hashes, HASH_SIZE);
+            file.store = &store;
+            expose_store(store);
+            pthread_mutex_unlock(&stores_lock);
+        }
 
-                    /* receive segment */
-                    MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, peer_rank, TAG_ACK, MPI_COMM_WORLD, &status);
+        updated_segments = 0;
 
-                    /* update file list */
-                    files[filename][segment].owned = true;
-                    missing_segments[filename]--;
+        /* keep up to download_window requests in flight, spread across the peers, until enough
+           segments were received to report them to the tracker */
+        while (updated_segments < UPDATE_INTERVAL && needed_segments > 0) {
+            receive_haves(data);
+            received.clear();
 
-                    if (missing_segments[filename] == 0) {
-                        /* client finished downloading file, send message to tracker */
-                        send_file_downloaded(filename.c_str());
+            for (int i = 0; i < download_window; i++) {
+                if (recv_requests[i] != MPI_REQUEST_NULL)
+                    continue;
 
-                        /* print information to file */
-                        print_info_to_file(rank, filename, num_segments, files);
+                download_slot &slot = slots[i];
+                if (!next_segment(slot.file, slot.segment, slot.peer) &&
+                    !next_duplicate(slots, files, load, slot.file, slot.segment, slot.peer))
+                    break;
+
+                slot.cancelled = false;
+
+                /* the segment is in the memory of a peer on this node, verify it with the replies */
+                if (take_from_node(slot)) {
+                    received.push_back(i);
+                    continue;
+                }
+
+                start_transfer(slot, i, &recv_requests[i]);
+                in_flight++;
+            }
+
+            /* none of the missing segments are available yet, ask the tracker again */
+            if (in_flight == 0 && received.empty())
+                break;
+
+            /* handle the segments in whatever order they arrive; replies that are already here are
+               collected too, so that up to hash_lanes segments are verified at once. Segments taken from
+               the node's shared memory are verified without waiting for the replies */
+            num_completed = 0;
+            METRIC_TIMER(waiting);
+            if (received.empty())
+                MPI_Waitsome(download_window, recv_requests.data(), &num_completed, completed.data(), statuses.data());
+            else if (in_flight > 0)
+                MPI_Testsome(download_window, recv_requests.data(), &num_completed, completed.data(), statuses.data());
+            METRIC_LATENCY(LATENCY_SEGMENT_WAIT, waiting);
+
+            do {
+                for (int c = 0; c < num_completed; c++) {
+                    download_slot &slot = slots[completed[c]];
+
+                    /* the status of an MPI_Get holds no count, it always reads the whole segment */
+                    int queued = -1;
+                    if (rma_fetch && !slot.locating) {
+                        slot.received = segment_size;
+                        METRIC_RECEIVED(TAG_SEGMENT_BASE + completed[c], slot.received);
+                    } else {
+                        MPI_Get_count(&statuses[c], MPI_CHAR, &slot.received);
+                        MPI_Wait(&slot.send_request, MPI_STATUS_IGNORE);
+                        METRIC_RECEIVED(TAG_SEGMENT_BASE + completed[c], slot.received);
+
+                        /* every reply but an address ends with the number of requests queued at the peer */
+                        if (!(slot.locating && slot.received == sizeof(MPI_Aint)) && slot.received >= (int)sizeof(int)) {
+                            slot.received -= sizeof(int);
+                            memcpy(&queued, slot.buffer.data() + slot.received, sizeof(int));
+                        }
+                    }
+
+                    /* the peer chokes the client, its reply is empty */
+                    if (queued == REPLY_CHOKED) {
+                        peer_choked(load, slot.peer);
+                        queued = -1;
                     }
 
-                    /* add filename, segment number and segment hash to the update message */
-                    strncpy(update + offset, filename.c_str(), MAX_FILENAME+1);
-                    offset += MAX_FILENAME+1;
+                    /* only the replies that bring a segment time the peer */
+                    bool timed = !slot.locating && slot.received == segment_size;
+                    peer_reply_received(load, slot.peer, timed ? MPI_Wtime() - slot.requested : -1, queued);
 
-                    strncpy(update + offset, (char *)&segment, sizeof(int));
-                    offset += sizeof(int);
+                    /* the peer told where its store of the file is, fetch the segment from it */
+                    if (slot.locating && slot.received == sizeof(MPI_Aint)) {
+                        MPI_Aint address;
+                        memcpy(&address, slot.buffer.data(), sizeof(MPI_Aint));
+                        files[slot.file].remote[slot.peer] = address;
 
-                    strncpy(update + offset, files[filename][segment].hash, HASH_SIZE+1);
-                    offset += HASH_SIZE+1;
+                        if (!slot.cancelled) {
+                            start_transfer(slot, completed[c], &recv_requests[completed[c]]);
+                            continue;
+                        }
+                    }
+                    METRIC_LATENCY(LATENCY_SEGMENT_RTT, slot.requested);
+
+                    received.push_back(completed[c]);
+                    slot.busy = false;
+                    in_flight--;
+                }
 
-                    /* update needed segments count */
-                    needed_segments--;
+                if (in_flight == 0 || (int)received.size() >= hash_lanes)
                     break;
+
+                MPI_Testsome(download_window, recv_requests.data(), &num_completed, completed.data(), statuses.data());
+            } while (num_completed > 0);
+
+            for (int c = 0; c < (int)received.size(); c++) {
+                payloads[c] = (const unsigned char *)slots[received[c]].source;
+            }
+            sha256_multi(payloads.data(), received.size(), segment_size, digests, hash_lanes);
+
+            for (int c = 0; c < (int)received.size(); c++) {
+                download_slot &slot = slots[received[c]];
+                client_file &file = files[slot.file];
+
+                /* another copy of the segment won the endgame */
+                if (slot.cancelled || bitfield_test(file.owned, slot.segment))
+                    continue;
+
+                /* the peer was too busy to take the request, the segment is asked again, from whichever
+                   holder is expected to be faster now */
+                if (slot.received == 0) {
+                    unpick_segment(file.picker, slot.segment);
+                    continue;
+                }
+
+                if (!verify_segment(slot.source, slot.received, digests[c], file.hashes + (size_t)slot.segment * HASH_SIZE, scratch_segment)) {
+                    /* ask another peer for the segment and demote the one that sent it */
+                    reject_segment(file.picker, slot.peer, slot.segment, load);
+                    continue;
                 }
+
+                /* stores_lock only guards the stores map, the file reaches its store through its pointer */
+                memcpy(segment_data(*file.store, slot.segment), slot.source, segment_size);
+                store_segment_held(*file.store, slot.segment);
+                writer_push(writer, file.store, slot.segment);
+
+                if (choke_uploads)
+                    choker_received(upload_slots, slot.peer, segment_size);
+
+                cancel_duplicates(slots, files, received[c], rma_fetch, data);
+                picker_segment_done(file.picker, slot.segment);
+
+                /* update file list */
+                bitfield_set(file.owned, slot.segment);
+                file.missing--;
+
+                if (file.missing == 0) {
+                    /* client finished downloading file, send message to tracker */
+                    send_file_downloaded(file.name.c_str(), num_trackers, data);
+
+                    /* flush the file to disk once its last segments are written */
+                    writer_finish(writer, file.store);
+
+                    if (stats.first_file == 0)
+                        stats.first_file = MPI_Wtime();
+                }
+
+                /* add the segment to the next update of the file */
+                bitfield_set(file.updated, slot.segment);
+
+                /* announce the segment to the swarm */
+                fresh.emplace_back(slot.file, slot.segment);
+                if ((int)fresh.size() >= HAVE_BATCH)
+                    send_haves(fresh, files, rank, scratch, haves);
+
+                /* update needed segments count */
+                updated_segments++;
+                needed_segments--;
+                stats.segments++;
             }
         }
 
-        /* send update to tracker */
-        MPI_Send(update, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_UPDATE, MPI_COMM_WORLD);
+        send_haves(fresh, files, rank, scratch, haves);
+
+        /* send updates to the tracker shards */
+        send_updates(files, scratch, num_trackers);
     } while (needed_segments > 0);
 
-    /* client finished downloading all files, send fin to tracker */
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_FIN, MPI_COMM_WORLD);
+    /* the uploads are shared out evenly from now on */
+    choker_seeding(upload_slots);
+
+    METRIC_COUNT_ALLOCATIONS(false);
+
+    /* wait for the replies to the cancelled requests, the peers answer every request */
+    MPI_Waitall(download_window, recv_requests.data(), MPI_STATUSES_IGNORE);
+    for (download_slot &slot: slots) {
+        MPI_Wait(&slot.send_request, MPI_STATUS_IGNORE);
+    }
+    pool_wait(haves);
+
+    /* the HAVEs the peers still send are received by the upload thread from now on */
+    send_message(NULL, 0, rank, TAG_HAVE);
+
+    if (rma_fetch)
+        MPI_Win_unlock_all(store_window);
+
+    /* client finished downloading all files, send fin to every tracker shard */
+    for (int shard = 0; shard < num_trackers; shard++) {
+        send_message(NULL, 0, shard, TAG_FIN);
+    }
+
+    stats.end = MPI_Wtime();
 
     return NULL;
 }
 
+/* Serve the segment requests queued by the upload thread: each segment is sent without blocking,
+   straight from its store, or an empty reply if the client does not hold it (yet) or the request was
+   cancelled. Both end with the number of requests still queued, which requesters use to avoid busy
+   uploaders. */
+void *upload_worker_func(void *arg) {
+    peer_queue &queue = *(peer_queue *) arg;
+    work_item item;
+    char filename[MAX_FILENAME+1];
+    int segment, reply_tag;
+    send_pool replies;
+
+    while (peer_queue_pop(queue, item)) {
+        parse_file_request(item.data.data(), filename, &segment, &reply_tag);
+
+        pthread_mutex_lock(&stores_lock);
+        auto it = stores.find(filename);
+        segment_store *store = it == stores.end() ? NULL : &it->second;
+        pthread_mutex_unlock(&stores_lock);
+
+        if (item.tag == TAG_REQUEST && store && segment == LOCATE_SEGMENT) {
+            /* the requester fetches the segments of the file itself, from the store window (-r) */
+            MPI_Aint address;
+            MPI_Get_address(store->data, &address);
+            pool_isend(replies, (const char *)&address, sizeof(MPI_Aint), item.source, reply_tag);
+
+        } else if (item.tag == TAG_REQUEST && store && segment >= 0 && (size_t)(segment + 1) * segment_size <= store->size &&
+                   store_holds(*store, segment)) {
+            if (upload_delay > 0)
+                usleep(upload_delay);
+
+            pool_isend_tail(replies, segment_data(*store, segment), segment_size, peer_queue_size(queue),
+                            item.source, reply_tag);
+
+            /* past its rate, the requester's next segments wait in the queue while the others are served */
+            if (choke_uploads || upload_rate > 0) {
+                double wait = choker_shape(upload_slots, item.source, segment_size, MPI_Wtime());
+                if (wait > 0)
+                    peer_queue_defer(queue, item.source, wait);
+            }
+            __atomic_fetch_add(&stats.uploads, 1, __ATOMIC_RELAXED);
+            METRIC_UPLOAD(item.source);
+        } else {
+            pool_isend_tail(replies, NULL, 0, peer_queue_size(queue), item.source, reply_tag);
+        }
+
+        METRIC_LATENCY(LATENCY_UPLOAD, item.received);
+    }
+
+    pool_wait(replies);
+
+    return NULL;
+}
+
+/* Post the receive of slot i of the upload thread: the first UPLOAD_RECEIVES slots receive requests,
+   the others cancellations. */
+void post_upload_receive(vector<vector<char>> &buffers, vector<MPI_Request> &requests, int i) {
+    int tag = i < UPLOAD_RECEIVES ? TAG_REQUEST : TAG_CANCEL;
+
+    MPI_Irecv(buffers[i].data(), UPLOAD_REQUEST_SIZE, MPI_CHAR, MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &requests[i]);
+}
+
+/* Receive the segment requests of other clients and hand them to the upload workers, until the tracker
+   sends FIN. Once the download thread is done, which it tells with an empty HAVE to its own rank, the
+   HAVEs of the peers are received here and dropped, so that none is left unmatched. */
 void *upload_thread_func(void *arg) {
-    char data[MAX_MESSAGE_LEN];
-    MPI_Status status;
+    int rank = *(int*) arg;
+    int num_receives = UPLOAD_RECEIVES + UPLOAD_CANCEL_RECEIVES + 1;
+    int have_slot = num_receives - 1;
+    vector<vector<char>> buffers(num_receives, vector<char>(UPLOAD_REQUEST_SIZE));
+    vector<MPI_Request> requests(num_receives);
+    vector<MPI_Status> statuses(num_receives);
+    vector<int> completed(num_receives);
+    int num_completed;
+    char filename[MAX_FILENAME+1];
+    int segment, reply_tag;
+
+    for (int i = 0; i < have_slot; i++) {
+        post_upload_receive(buffers, requests, i);
+    }
 
-    while (true) {
-        /* receive message */
-        MPI_Recv(data, MAX_MESSAGE_LEN, MPI_CHAR, MPI_ANY_SOURCE, TAG_REQUEST, MPI_COMM_WORLD, &status);
+    buffers[have_slot].resize(HAVE_MESSAGE_SIZE);
+    MPI_Irecv(buffers[have_slot].data(), HAVE_MESSAGE_SIZE, MPI_CHAR, rank, TAG_HAVE, MPI_COMM_WORLD,
+              &requests[have_slot]);
 
-        /* check if message received is FIN from the tracker */
-        if (!strncmp(data, "FIN", 3))
-            break;
+    peer_queue queue;
+    init_peer_queue(queue, UPLOAD_QUEUE_DEPTH);
 
-        /* send ACK */
-        MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, status.MPI_SOURCE, TAG_ACK, MPI_COMM_WORLD);
+    pthread_t workers[UPLOAD_WORKERS];
+    for (int i = 0; i < UPLOAD_WORKERS; i++) {
+        if (pthread_create(&workers[i], NULL, upload_worker_func, (void *) &queue)) {
+            printf("Eroare la crearea thread-ului de upload\n");
+            exit(-1);
+        }
+    }
+
+    bool running = true;
+    work_item item;
+
+    while (running) {
+        MPI_Waitsome(num_receives, requests.data(), &num_completed, completed.data(), statuses.data());
+
+        for (int c = 0; c < num_completed; c++) {
+            int i = completed[c];
+            int len;
+            MPI_Get_count(&statuses[c], MPI_CHAR, &len);
+            METRIC_RECEIVED(statuses[c].MPI_TAG, len);
+
+            if (i == have_slot) {
+                MPI_Irecv(buffers[i].data(), HAVE_MESSAGE_SIZE, MPI_CHAR, MPI_ANY_SOURCE, TAG_HAVE, MPI_COMM_WORLD,
+                          &requests[i]);
+                continue;
+            }
+
+            /* check if message received is FIN from the tracker */
+            if (statuses[c].MPI_SOURCE == TRACKER_RANK && !strncmp(buffers[i].data(), "FIN", 3)) {
+                running = false;
+                continue;
+            }
+
+            if (statuses[c].MPI_TAG == TAG_CANCEL) {
+                /* the worker replies with an empty message if it did not take the request yet */
+                parse_cancel(buffers[i].data(), filename, &segment, &reply_tag);
+                peer_queue_retag(queue, statuses[c].MPI_SOURCE, reply_tag, filename, segment, TAG_CANCEL);
+
+            } else {
+                parse_file_request(buffers[i].data(), filename, &segment, &reply_tag);
+
+                item.source = statuses[c].MPI_SOURCE;
+                item.tag = TAG_REQUEST;
+                item.key = reply_tag;
+                item.data.assign(buffers[i].data(), buffers[i].data() + len);
+                METRIC_STAMP(item.received);
+
+                /* a choked requester gets an empty reply that says so, and asks other holders */
+                if (choke_uploads && segment >= 0 && !choker_admit(upload_slots, item.source, MPI_Wtime())) {
+                    int choked = REPLY_CHOKED;
+                    send_message((const char *)&choked, sizeof(int), item.source, reply_tag);
+                    post_upload_receive(buffers, requests, i);
+                    continue;
+                }
+
+                /* the requester has too many requests waiting, tell it to ask someone else and how busy
+                   this client is */
+                if (!peer_queue_push(queue, item)) {
+                    int queued = peer_queue_size(queue);
+                    send_message((const char *)&queued, sizeof(int), item.source, reply_tag);
+                }
+            }
+
+            post_upload_receive(buffers, requests, i);
+        }
+    }
+
+    /* every client is done, so no request is left unanswered; the workers finish their sends and stop */
+    for (int i = 0; i < num_receives; i++) {
+        if (requests[i] == MPI_REQUEST_NULL)
+            continue;
+
+        MPI_Cancel(&requests[i]);
+        MPI_Wait(&requests[i], MPI_STATUS_IGNORE);
+    }
+
+    close_peer_queue(queue);
+
+    for (int i = 0; i < UPLOAD_WORKERS; i++) {
+        pthread_join(workers[i], NULL);
     }
 
     return NULL;
@@ -244,11 +1032,19 @@ void *upload_thread_func(void *arg) {
 void peer(int numtasks, int rank) {
     pthread_t download_thread;
     pthread_t upload_thread;
+    pthread_t writer_thread;
     void *status;
     int r;
 
     /* Initialize client */
-    init_client(rank);
+    init_client(numtasks, rank);
+
+    init_disk_writer(writer, WRITER_BACKLOG);
+    r = pthread_create(&writer_thread, NULL, disk_writer_func, (void *) &writer);
+    if (r) {
+        printf("Eroare la crearea thread-ului de scriere\n");
+        exit(-1);
+    }
 
     r = pthread_create(&download_thread, NULL, download_thread_func, (void *) &rank);
     if (r) {
@@ -273,6 +1069,14 @@ void peer(int numtasks, int rank) {
         printf("Eroare la asteptarea thread-ului de upload\n");
         exit(-1);
     }
+
+    /* the downloads are over, wait for the writer to flush the last segments */
+    close_disk_writer(writer);
+    r = pthread_join(writer_thread, &status);
+    if (r) {
+        printf("Eroare la asteptarea thread-ului de scriere\n");
+        exit(-1);
+    }
 }
 
 int main (int argc, char *argv[]) {
@@ -287,12 +1091,90 @@ int main (int argc, char *argv[]) {
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-    if (rank == TRACKER_RANK) {
+    stats.start = MPI_Wtime();
+
+    /* -w <N>: number of outstanding segment requests per client
+       -s <bytes>: segment size
+       -d <dir>: directory holding the data of the seeded files
+       -t <N>: number of tracker shards
+       -j <file>: write a JSON report of the run
+       -m <prefix>: write the metrics of each rank to <prefix>.<rank>.json and their sum to <prefix>.json
+       -r: fetch segments with one-sided MPI_Get instead of requesting them from the uploader
+       -l: copy segments from the clients on the same node through shared memory
+       -u <microseconds>: delay every segment this client uploads (benchmarks of slow peers)
+       -k: only serve the peers this client unchokes, tit-for-tat with an optimistic unchoke
+       -b <KB/s>: send each peer at most this many kilobytes per second */
+    int opt;
+    while ((opt = getopt(argc, argv, "w:s:d:t:j:m:rlu:kb:")) != -1) {
+        if (opt == 'w') {
+            download_window = max(1, atoi(optarg));
+        } else if (opt == 's') {
+            segment_size = max(1, atoi(optarg));
+        } else if (opt == 'd') {
+            data_dir = optarg;
+        } else if (opt == 't') {
+            num_trackers = min(max(1, atoi(optarg)), numtasks - 1);
+        } else if (opt == 'j') {
+            report_path = optarg;
+        } else if (opt == 'm') {
+            metrics_prefix = optarg;
+        } else if (opt == 'r') {
+            rma_fetch = true;
+        } else if (opt == 'l') {
+            shared_stores = true;
+        } else if (opt == 'u') {
+            upload_delay = max(0, atoi(optarg));
+        } else if (opt == 'k') {
+            choke_uploads = true;
+        } else if (opt == 'b') {
+            upload_rate = max(0.0, atof(optarg)) * 1024;
+        }
+    }
+
+    /* the reply to the request of slot i comes with tag TAG_SEGMENT_BASE + i, and MPI only guarantees tags
+       up to 32767; the largest tag of this MPI is MPI_TAG_UB */
+    int *tag_ub, found;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &tag_ub, &found);
+    if (found && download_window - 1 > *tag_ub - TAG_SEGMENT_BASE) {
+        fprintf(stderr, "-w %d: the reply tags would exceed MPI_TAG_UB (%d), use at most -w %d\n", download_window,
+                *tag_ub, *tag_ub - TAG_SEGMENT_BASE + 1);
+        exit(-1);
+    }
+
+#ifdef METRICS
+    metrics_init(numtasks);
+#else
+    if (metrics_prefix && rank == 0)
+        fprintf(stderr, "-m ignored, build with METRICS=1 to collect metrics\n");
+    metrics_prefix = NULL;
+#endif
+
+    /* every client attaches its stores to the window as it maps them */
+    if (rma_fetch)
+        MPI_Win_create_dynamic(MPI_INFO_NULL, MPI_COMM_WORLD, &store_window);
+
+    /* the clients allocate their shared window once they know the size of their files */
+    if (shared_stores)
+        split_node_share(node, num_trackers, rank, numtasks);
+
+    if (rank < num_trackers) {
         tracker(numtasks, rank);
 
     } else {
         peer(numtasks, rank);
     }
 
+    if (report_path)
+        write_report(report_path, stats, rank, numtasks, num_trackers, segment_size);
+
+    if (metrics_prefix)
+        write_metrics(metrics_prefix, rank, numtasks);
+
+    if (rma_fetch)
+        MPI_Win_free(&store_window);
+
+    if (shared_stores)
+        free_node_share(node);
+
     MPI_Finalize();
 }
@@ -0,0 +1,73 @@
+#include "manifest.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void invalid_manifest(const char *path, const char *reason) {
+    fprintf(stderr, "%s: invalid manifest, %s\n", path, reason);
+    exit(-1);
+}
+
+/* A name fits if it is null terminated within max_name + 1 bytes and not empty. */
+static bool valid_name(const char *name, int max_name) {
+    return name[0] && memchr(name, 0, max_name + 1) != NULL;
+}
+
+/* Map the binary manifest at path. Returns false if there is no such file; a manifest that does not hold
+   together (hashes out of the file, names longer than max_name, another hash size) is fatal. */
+bool open_manifest(manifest &m, const char *path, int hash_size, int max_name) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(manifest_header))
+        invalid_manifest(path, "too short");
+
+    m.size = st.st_size;
+    m.data = (const char *)mmap(NULL, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (m.data == MAP_FAILED) {
+        perror(path);
+        exit(-1);
+    }
+
+    const manifest_header *header = (const manifest_header *)m.data;
+    if (memcmp(header->magic, MANIFEST_MAGIC, 4))
+        invalid_manifest(path, "bad magic");
+    if ((int)header->hash_size != hash_size)
+        invalid_manifest(path, "wrong hash size");
+
+    m.num_files = header->num_files;
+    m.num_wanted = header->num_wanted;
+    m.files = (const manifest_file *)(m.data + sizeof(manifest_header));
+    m.wanted = (const char (*)[MANIFEST_NAME_SIZE])(m.files + m.num_files);
+
+    size_t tables = sizeof(manifest_header) + (size_t)m.num_files * sizeof(manifest_file) +
+                    (size_t)m.num_wanted * MANIFEST_NAME_SIZE;
+    if (tables > m.size)
+        invalid_manifest(path, "truncated tables");
+
+    for (int i = 0; i < m.num_files; i++) {
+        const manifest_file &file = m.files[i];
+
+        if (!valid_name(file.name, max_name))
+            invalid_manifest(path, "bad file name");
+        if (file.hashes < tables || file.hashes > m.size ||
+            (m.size - file.hashes) / hash_size < file.num_segments)
+            invalid_manifest(path, "hashes out of the file");
+    }
+
+    for (int i = 0; i < m.num_wanted; i++) {
+        if (!valid_name(m.wanted[i], max_name))
+            invalid_manifest(path, "bad wanted file name");
+    }
+
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary manifest (in<id>.bin), the input of a client mapped in memory and read in place:
+
+   manifest_header | num_files * manifest_file | num_wanted * MANIFEST_NAME_SIZE | hashes
+
+   Names are null padded; each owned file has num_segments * hash_size hash bytes at its hashes offset.
+   bench/convert_manifest.py writes it from the in<id>.txt text format. */
+#define MANIFEST_MAGIC "BTM1"
+#define MANIFEST_NAME_SIZE 16
+
+typedef struct {
+    char magic[4];
+    uint32_t num_files;
+    uint32_t num_wanted;
+    uint32_t hash_size;
+} manifest_header;
+
+typedef struct {
+    char name[MANIFEST_NAME_SIZE];
+    uint32_t num_segments;
+    uint32_t reserved;
+    uint64_t hashes;
+} manifest_file;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    int num_files;
+    int num_wanted;
+    const manifest_file *files;
+    const char (*wanted)[MANIFEST_NAME_SIZE];
+} manifest;
+
+bool open_manifest(manifest &m, const char *path, int hash_size, int max_name);
+
+static inline const char *manifest_hashes(manifest &m, int file) {
+    return m.data + m.files[file].hashes;
+}
+
+#endif
@@ -0,0 +1,265 @@
+#include "message.h"
+#include "metrics.h"
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+
+/* Payloads larger than INT_MAX bytes are described with a derived datatype made of
+   MESSAGE_BLOCK sized blocks followed by the remaining bytes. */
+#define MESSAGE_BLOCK (1 << 30)
+
+/* Append an int to the message. */
+void put_int(vector<char> &msg, int value) {
+    put_bytes(msg, (const char *)&value, sizeof(int));
+}
+
+/* Append len raw bytes to the message. */
+void put_bytes(vector<char> &msg, const char *bytes, int len) {
+    msg.insert(msg.end(), bytes, bytes + len);
+}
+
+/* Append a string as {length, characters}, without the terminating null byte. */
+void put_string(vector<char> &msg, const char *str) {
+    int len = strlen(str);
+
+    put_int(msg, len);
+    put_bytes(msg, str, len);
+}
+
+/* Append 64-bit words (bitfields), in the byte order of the host like every other field. */
+void put_words(vector<char> &msg, const uint64_t *words, int num_words) {
+    put_bytes(msg, (const char *)words, num_words * sizeof(uint64_t));
+}
+
+/* Read an int from data at offset and advance the offset. */
+int get_int(const char *data, int &offset) {
+    int value;
+
+    memcpy(&value, data + offset, sizeof(int));
+    offset += sizeof(int);
+
+    return value;
+}
+
+/* Read len raw bytes from data at offset and advance the offset. */
+void get_bytes(const char *data, int &offset, char *bytes, int len) {
+    memcpy(bytes, data + offset, len);
+    offset += len;
+}
+
+/* Read a string written by put_string into str (at most max_len characters plus the null byte). */
+void get_string(const char *data, int &offset, char *str, int max_len) {
+    int len = get_int(data, offset);
+
+    memcpy(str, data + offset, min(len, max_len));
+    str[min(len, max_len)] = '\0';
+    offset += len;
+}
+
+/* Read num_words 64-bit words from data at offset and advance the offset. */
+void get_words(const char *data, int &offset, uint64_t *words, int num_words) {
+    get_bytes(data, offset, (char *)words, num_words * sizeof(uint64_t));
+}
+
+/* Build the datatype used to transfer len bytes in a single message. Returns the number of
+   elements of *type to send; *type must be freed by the caller if it is not MPI_CHAR. */
+static int message_datatype(size_t len, MPI_Datatype *type) {
+    if (len <= INT_MAX) {
+        *type = MPI_CHAR;
+        return len;
+    }
+
+    MPI_Datatype block;
+    MPI_Type_contiguous(MESSAGE_BLOCK, MPI_CHAR, &block);
+
+    int lengths[2] = {(int)(len / MESSAGE_BLOCK), (int)(len % MESSAGE_BLOCK)};
+    MPI_Aint displacements[2] = {0, (MPI_Aint)(len / MESSAGE_BLOCK) * MESSAGE_BLOCK};
+    MPI_Datatype types[2] = {block, MPI_CHAR};
+
+    MPI_Type_create_struct(2, lengths, displacements, types, type);
+    MPI_Type_commit(type);
+    MPI_Type_free(&block);
+
+    return 1;
+}
+
+/* NULL: messages go through MPI */
+static message_transport transport = NULL;
+
+void set_message_transport(message_transport t) {
+    transport = t;
+}
+
+/* Send exactly len bytes of data, however large. */
+void send_message(const char *data, size_t len, int dest, int tag) {
+    if (transport) {
+        transport(data, len, dest, tag);
+        return;
+    }
+
+    MPI_Datatype type;
+    int count = message_datatype(len, &type);
+
+    MPI_Send(data, count, type, dest, tag, MPI_COMM_WORLD);
+    METRIC_SENT(tag, len);
+
+    if (type != MPI_CHAR)
+        MPI_Type_free(&type);
+}
+
+void send_message(const vector<char> &msg, int dest, int tag) {
+    send_message(msg.data(), msg.size(), dest, tag);
+}
+
+/* Start sending len bytes of data without blocking; data must not change until the request completes. */
+void isend_message(const char *data, size_t len, int dest, int tag, MPI_Request *request) {
+    if (transport) {
+        transport(data, len, dest, tag);
+        *request = MPI_REQUEST_NULL;
+        return;
+    }
+
+    MPI_Datatype type;
+    int count = message_datatype(len, &type);
+
+    MPI_Isend(data, count, type, dest, tag, MPI_COMM_WORLD, request);
+    METRIC_SENT(tag, len);
+
+    if (type != MPI_CHAR)
+        MPI_Type_free(&type);
+}
+
+void isend_message(const vector<char> &msg, int dest, int tag, MPI_Request *request) {
+    isend_message(msg.data(), msg.size(), dest, tag, request);
+}
+
+/* Index of a request of the pool whose send completed, adding one if they are all in progress. */
+static int pool_slot(send_pool &pool) {
+    int num_completed;
+    pool.completed.resize(pool.requests.size());
+
+    /* with a transport every send is complete */
+    if (!pool.requests.empty() && !transport)
+        MPI_Testsome(pool.requests.size(), pool.requests.data(), &num_completed, pool.completed.data(), MPI_STATUSES_IGNORE);
+
+    for (int i = 0; i < (int)pool.requests.size(); i++) {
+        if (pool.requests[i] == MPI_REQUEST_NULL)
+            return i;
+    }
+
+    pool.requests.push_back(MPI_REQUEST_NULL);
+    pool.buffers.emplace_back();
+
+    return pool.requests.size() - 1;
+}
+
+/* Start sending msg without blocking from a buffer of the pool: the contents of msg are swapped with
+   a buffer whose send completed, which the caller can reuse. */
+void pool_isend(send_pool &pool, vector<char> &msg, int dest, int tag) {
+    int slot = pool_slot(pool);
+
+    pool.buffers[slot].swap(msg);
+    isend_message(pool.buffers[slot], dest, tag, &pool.requests[slot]);
+}
+
+/* Start sending len bytes of data without blocking, from memory that outlives the send. */
+void pool_isend(send_pool &pool, const char *data, size_t len, int dest, int tag) {
+    int slot = pool_slot(pool);
+
+    isend_message(data, len, dest, tag, &pool.requests[slot]);
+}
+
+/* Start sending len bytes of data followed by the int tail without blocking, in one message: data, which
+   must outlive the send, is not copied, the tail is kept in a buffer of the pool. */
+void pool_isend_tail(send_pool &pool, const char *data, int len, int tail, int dest, int tag) {
+    int slot = pool_slot(pool);
+    vector<char> &buffer = pool.buffers[slot];
+
+    buffer.resize(sizeof(int));
+    memcpy(buffer.data(), &tail, sizeof(int));
+
+    if (len == 0) {
+        isend_message(buffer, dest, tag, &pool.requests[slot]);
+        return;
+    }
+
+    /* both parts are described by their address, the message is sent from MPI_BOTTOM */
+    int lengths[2] = {len, (int)sizeof(int)};
+    MPI_Aint displacements[2];
+    MPI_Datatype types[2] = {MPI_CHAR, MPI_CHAR};
+    MPI_Datatype type;
+
+    MPI_Get_address(data, &displacements[0]);
+    MPI_Get_address(buffer.data(), &displacements[1]);
+    MPI_Type_create_struct(2, lengths, displacements, types, &type);
+    MPI_Type_commit(&type);
+
+    MPI_Isend(MPI_BOTTOM, 1, type, dest, tag, MPI_COMM_WORLD, &pool.requests[slot]);
+    METRIC_SENT(tag, len + sizeof(int));
+
+    MPI_Type_free(&type);
+}
+
+/* Index of a buffer of the pool whose send completed, emptied but keeping its capacity, to build the next
+   message in place; it is sent with pool_isend(pool, slot, ...) before the next pool call. */
+int pool_take(send_pool &pool) {
+    int slot = pool_slot(pool);
+
+    pool.buffers[slot].clear();
+    return slot;
+}
+
+/* Start sending the message built in the buffer of slot without blocking. */
+void pool_isend(send_pool &pool, int slot, int dest, int tag) {
+    isend_message(pool.buffers[slot], dest, tag, &pool.requests[slot]);
+}
+
+/* Wait for every send of the pool to complete. */
+void pool_wait(send_pool &pool) {
+    MPI_Waitall(pool.requests.size(), pool.requests.data(), MPI_STATUSES_IGNORE);
+}
+
+/* Receive the message matched by a probe, of any size, into msg. */
+static size_t recv_matched(vector<char> &msg, MPI_Message *handle, MPI_Status *status) {
+    MPI_Count len;
+
+    MPI_Get_elements_x(status, MPI_CHAR, &len);
+
+    msg.resize(len);
+
+    MPI_Datatype type;
+    int count = message_datatype(len, &type);
+
+    MPI_Mrecv(msg.data(), count, type, handle, status);
+    METRIC_RECEIVED(status->MPI_TAG, len);
+
+    if (type != MPI_CHAR)
+        MPI_Type_free(&type);
+
+    return len;
+}
+
+/* Receive a message of any size into msg, which is resized to the exact payload length.
+   A matched probe is used so that the upload and download threads of a client can receive
+   concurrently without stealing each other's messages between the probe and the receive. */
+size_t recv_message(vector<char> &msg, int source, int tag, MPI_Status *status) {
+    MPI_Message handle;
+
+    MPI_Mprobe(source, tag, MPI_COMM_WORLD, &handle, status);
+
+    return recv_matched(msg, &handle, status);
+}
+
+/* Receive a message into msg only if one has already arrived. Returns false if there is none. */
+bool try_recv_message(vector<char> &msg, int source, int tag, MPI_Status *status) {
+    MPI_Message handle;
+    int flag;
+
+    MPI_Improbe(source, tag, MPI_COMM_WORLD, &flag, &handle, status);
+    if (!flag)
+        return false;
+
+    recv_matched(msg, &handle, status);
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef __MESSAGE_H__
+#define __MESSAGE_H__
+
+#include <mpi.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/* Messages being sent without blocking, each buffer is kept until its send completes. A pool is used
+   by a single thread. */
+typedef struct {
+    vector<vector<char>> buffers;
+    vector<MPI_Request> requests;
+    /* scratch for the indices of the completed sends */
+    vector<int> completed;
+} send_pool;
+
+/* Delivers a message instead of MPI: with a transport set, send_message and isend_message hand every
+   message to it, and the sends complete at once. The swarm simulator (bench/swarm_sim.cpp) runs the
+   client and tracker logic in one process this way. */
+typedef void (*message_transport)(const char *data, size_t len, int dest, int tag);
+
+void set_message_transport(message_transport transport);
+
+void put_int(vector<char> &msg, int value);
+
+void put_bytes(vector<char> &msg, const char *bytes, int len);
+
+void put_string(vector<char> &msg, const char *str);
+
+void put_words(vector<char> &msg, const uint64_t *words, int num_words);
+
+int get_int(const char *data, int &offset);
+
+void get_bytes(const char *data, int &offset, char *bytes, int len);
+
+void get_string(const char *data, int &offset, char *str, int max_len);
+
+void get_words(const char *data, int &offset, uint64_t *words, int num_words);
+
+void send_message(const char *data, size_t len, int dest, int tag);
+
+void send_message(const vector<char> &msg, int dest, int tag);
+
+void isend_message(const char *data, size_t len, int dest, int tag, MPI_Request *request);
+
+void isend_message(const vector<char> &msg, int dest, int tag, MPI_Request *request);
+
+void pool_isend(send_pool &pool, vector<char> &msg, int dest, int tag);
+
+void pool_isend(send_pool &pool, const char *data, size_t len, int dest, int tag);
+
+void pool_isend_tail(send_pool &pool, const char *data, int len, int tail, int dest, int tag);
+
+int pool_take(send_pool &pool);
+
+void pool_isend(send_pool &pool, int slot, int dest, int tag);
+
+void pool_wait(send_pool &pool);
+
+size_t recv_message(vector<char> &msg, int source, int tag, MPI_Status *status);
+
+bool try_recv_message(vector<char> &msg, int source, int tag, MPI_Status *status);
+
+#endif
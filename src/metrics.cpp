@@ -0,0 +1,219 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+static const char *latency_names[NUM_LATENCIES] = {
+    "segment_rtt", "segment_wait", "peer_list_wait", "upload", "tracker_request", "tracker_update",
+};
+
+/* everything that is summed across ranks, kept as one array of uint64_t so it is reduced at once */
+typedef struct {
+    uint64_t sent_messages[METRICS_TAGS];
+    uint64_t sent_bytes[METRICS_TAGS];
+    uint64_t received_messages[METRICS_TAGS];
+    uint64_t received_bytes[METRICS_TAGS];
+    uint64_t latency_count[NUM_LATENCIES];
+    uint64_t latency_buckets[NUM_LATENCIES][HISTOGRAM_BUCKETS];
+    /* operator new calls made by a thread while it counts them: the download loop after its first round */
+    uint64_t allocations;
+} metric_counters;
+
+/* the threads of a rank (download, upload and its workers, tracker workers) update the counters and the
+   latency sums and maxima concurrently, all with relaxed atomics */
+static metric_counters counters;
+static double latency_sum[NUM_LATENCIES];
+static double latency_max[NUM_LATENCIES];
+
+/* uploads[rank] = segments sent to that rank */
+static vector<uint64_t> uploads;
+
+static void add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/* The doubles have no atomic add, both are compare-and-swap loops. */
+static void add_seconds(double *sum, double seconds) {
+    double old, updated;
+    __atomic_load(sum, &old, __ATOMIC_RELAXED);
+
+    do {
+        updated = old + seconds;
+    } while (!__atomic_compare_exchange(sum, &old, &updated, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void max_seconds(double *max, double seconds) {
+    double old;
+    __atomic_load(max, &old, __ATOMIC_RELAXED);
+
+    while (seconds > old && !__atomic_compare_exchange(max, &old, &seconds, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static int tag_index(int tag) {
+    return tag >= 0 && tag < METRICS_TAGS ? tag : METRICS_TAGS - 1;
+}
+
+void metrics_init(int numtasks) {
+    uploads.assign(numtasks, 0);
+}
+
+void metrics_sent(int tag, size_t bytes) {
+    add(&counters.sent_messages[tag_index(tag)], 1);
+    add(&counters.sent_bytes[tag_index(tag)], bytes);
+}
+
+void metrics_received(int tag, size_t bytes) {
+    add(&counters.received_messages[tag_index(tag)], 1);
+    add(&counters.received_bytes[tag_index(tag)], bytes);
+}
+
+void metrics_latency(metric_latency kind, double seconds) {
+    uint64_t us = seconds * 1e6;
+    int bucket = 0;
+
+    while (us > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    add(&counters.latency_count[kind], 1);
+    add(&counters.latency_buckets[kind][bucket], 1);
+    add_seconds(&latency_sum[kind], seconds);
+    max_seconds(&latency_max[kind], seconds);
+}
+
+void metrics_upload(int peer) {
+    if (peer >= 0 && peer < (int)uploads.size())
+        add(&uploads[peer], 1);
+}
+
+static thread_local bool counting_allocations = false;
+
+/* Count the allocations the calling thread makes from now on, or stop counting them. */
+void metrics_count_allocations(bool on) {
+    counting_allocations = on;
+}
+
+#ifdef METRICS
+
+/* operator new is replaced in METRICS builds only, to count the allocations of the threads that asked for
+   it; the default operator new[] calls it, and the default operator delete frees its memory with free.
+   Allocations made inside MPI (with malloc) are not seen. */
+void *operator new(size_t size) {
+    if (counting_allocations)
+        add(&counters.allocations, 1);
+
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+#endif
+
+/* Upper bound in seconds of the bucket holding the q quantile of a histogram. */
+static double histogram_quantile(const uint64_t *buckets, uint64_t count, double q) {
+    uint64_t seen = 0;
+
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > 0 && seen >= q * count)
+            return (double)(2ULL << b) * 1e-6;
+    }
+
+    return 0;
+}
+
+static void print_counters(FILE *fp, const char *name, const uint64_t *values) {
+    fprintf(fp, "  \"%s\": {", name);
+
+    bool first = true;
+    for (int t = 0; t < METRICS_TAGS; t++) {
+        if (values[t] == 0)
+            continue;
+
+        if (t == METRICS_TAGS - 1)
+            fprintf(fp, "%s\"segment\": %llu", first ? "" : ", ", (unsigned long long)values[t]);
+        else
+            fprintf(fp, "%s\"%d\": %llu", first ? "" : ", ", t, (unsigned long long)values[t]);
+        first = false;
+    }
+
+    fprintf(fp, "},\n");
+}
+
+static void print_array(FILE *fp, const char *name, const uint64_t *values, int n) {
+    fprintf(fp, "  \"%s\": [", name);
+    for (int i = 0; i < n; i++) {
+        fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)values[i]);
+    }
+    fprintf(fp, "]\n");
+}
+
+static void print_metrics(const char *path, int rank, const metric_counters &c, const double *sum,
+                          const double *max, const uint64_t *upload_counts, int numtasks, const char *uploads_name) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return;
+    }
+
+    fprintf(fp, "{\n");
+    if (rank >= 0)
+        fprintf(fp, "  \"rank\": %d,\n", rank);
+
+    print_counters(fp, "sent_messages", c.sent_messages);
+    print_counters(fp, "sent_bytes", c.sent_bytes);
+    print_counters(fp, "received_messages", c.received_messages);
+    print_counters(fp, "received_bytes", c.received_bytes);
+    fprintf(fp, "  \"download_allocations\": %llu,\n", (unsigned long long)c.allocations);
+
+    fprintf(fp, "  \"latency\": {\n");
+    for (int l = 0; l < NUM_LATENCIES; l++) {
+        uint64_t count = c.latency_count[l];
+
+        fprintf(fp, "    \"%s\": {\"count\": %llu, \"mean\": %.9f, \"max\": %.9f, \"p50\": %.9f, \"p99\": %.9f, \"buckets_log2_us\": [",
+                latency_names[l], (unsigned long long)count, count ? sum[l] / count : 0, max[l],
+                histogram_quantile(c.latency_buckets[l], count, 0.5), histogram_quantile(c.latency_buckets[l], count, 0.99));
+
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            fprintf(fp, "%s%llu", b ? ", " : "", (unsigned long long)c.latency_buckets[l][b]);
+        }
+        fprintf(fp, "]}%s\n", l + 1 < NUM_LATENCIES ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+
+    print_array(fp, uploads_name, upload_counts, numtasks);
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
+
+/* Write the metrics of this rank to <prefix>.<rank>.json, and the swarm-wide sums to <prefix>.json
+   on rank 0. Called by every rank. */
+void write_metrics(const char *prefix, int rank, int numtasks) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s.%d.json", prefix, rank);
+    print_metrics(path, rank, counters, latency_sum, latency_max, uploads.data(), numtasks, "uploads_to_rank");
+
+    metric_counters total;
+    double total_sum[NUM_LATENCIES], total_max[NUM_LATENCIES];
+    vector<uint64_t> total_uploads(numtasks);
+
+    MPI_Reduce(&counters, &total, sizeof(counters) / sizeof(uint64_t), MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(latency_sum, total_sum, NUM_LATENCIES, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(latency_max, total_max, NUM_LATENCIES, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(uploads.data(), total_uploads.data(), numtasks, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank != 0)
+        return;
+
+    snprintf(path, sizeof(path), "%s.json", prefix);
+    print_metrics(path, -1, total, total_sum, total_max, total_uploads.data(), numtasks, "downloads_by_rank");
+}
@@ -0,0 +1,68 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <mpi.h>
+#include <stdint.h>
+
+/* Hot path instrumentation, compiled in with -DMETRICS (make build METRICS=1). Without it the
+   METRIC_* macros expand to nothing, so they cost nothing in a normal build. */
+
+/* message counters are kept per tag; segment replies (TAG_SEGMENT_BASE + slot) and any other
+   tag from METRICS_TAGS - 1 up share the last counter */
+#define METRICS_TAGS 16
+
+/* latency histograms have one bucket per power of two microseconds */
+#define HISTOGRAM_BUCKETS 32
+
+enum metric_latency {
+    /* client: from sending a segment request to receiving the segment */
+    LATENCY_SEGMENT_RTT,
+    /* client: time the download thread is blocked waiting for segments or for peer lists */
+    LATENCY_SEGMENT_WAIT,
+    LATENCY_PEER_LIST_WAIT,
+    /* client: from receiving a segment request to the worker having sent its reply, queue wait included */
+    LATENCY_UPLOAD,
+    /* tracker: from receiving a request or an update to a worker having handled it (send_peer_list,
+       parse_update), queue wait included */
+    LATENCY_TRACKER_REQUEST,
+    LATENCY_TRACKER_UPDATE,
+    NUM_LATENCIES
+};
+
+#ifdef METRICS
+
+#define METRIC_TIMER(t) double t = MPI_Wtime()
+#define METRIC_STAMP(t) ((t) = MPI_Wtime())
+#define METRIC_LATENCY(kind, t) metrics_latency(kind, MPI_Wtime() - (t))
+#define METRIC_SENT(tag, bytes) metrics_sent(tag, bytes)
+#define METRIC_RECEIVED(tag, bytes) metrics_received(tag, bytes)
+#define METRIC_UPLOAD(peer) metrics_upload(peer)
+#define METRIC_COUNT_ALLOCATIONS(on) metrics_count_allocations(on)
+
+#else
+
+#define METRIC_TIMER(t)
+#define METRIC_STAMP(t) ((void)0)
+#define METRIC_LATENCY(kind, t) ((void)0)
+#define METRIC_SENT(tag, bytes) ((void)0)
+#define METRIC_RECEIVED(tag, bytes) ((void)0)
+#define METRIC_UPLOAD(peer) ((void)0)
+#define METRIC_COUNT_ALLOCATIONS(on) ((void)0)
+
+#endif
+
+void metrics_init(int numtasks);
+
+void metrics_sent(int tag, size_t bytes);
+
+void metrics_received(int tag, size_t bytes);
+
+void metrics_latency(metric_latency kind, double seconds);
+
+void metrics_upload(int peer);
+
+void metrics_count_allocations(bool on);
+
+void write_metrics(const char *prefix, int rank, int numtasks);
+
+#endif
@@ -0,0 +1,116 @@
+#include "node_share.h"
+
+#include <string.h>
+
+/* Find the clients that run on the same node as this rank. Called by every rank, the trackers only take
+   part in the split. */
+void split_node_share(node_share &share, int num_trackers, int rank, int numtasks) {
+    MPI_Comm clients;
+    MPI_Comm_split(MPI_COMM_WORLD, rank < num_trackers ? MPI_UNDEFINED : 0, rank, &clients);
+
+    share.comm = MPI_COMM_NULL;
+    share.window = MPI_WIN_NULL;
+    share.node_rank.assign(numtasks, -1);
+    share.local.assign(numtasks, false);
+
+    if (clients == MPI_COMM_NULL)
+        return;
+
+    MPI_Comm_split_type(clients, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &share.comm);
+    MPI_Comm_free(&clients);
+
+    /* world rank of each client on the node */
+    MPI_Group world, node;
+    MPI_Comm_group(MPI_COMM_WORLD, &world);
+    MPI_Comm_group(share.comm, &node);
+
+    int node_size;
+    MPI_Group_size(node, &node_size);
+    vector<int> node_ranks(node_size), world_ranks(node_size);
+    for (int i = 0; i < node_size; i++) {
+        node_ranks[i] = i;
+    }
+    MPI_Group_translate_ranks(node, node_size, node_ranks.data(), world, world_ranks.data());
+
+    for (int i = 0; i < node_size; i++) {
+        share.node_rank[world_ranks[i]] = i;
+        share.local[world_ranks[i]] = world_ranks[i] != rank;
+    }
+
+    MPI_Group_free(&world);
+    MPI_Group_free(&node);
+}
+
+/* Allocate the shared window, collectively with the other clients on the node, with a region for this
+   client holding sizes[filename] bytes for each of its files. placed[filename] is set to where each file
+   goes in the region. */
+void allocate_node_share(node_share &share, map<string, size_t> &sizes, map<string, char *> &placed) {
+    size_t offset = sizeof(int) + sizes.size() * sizeof(shared_entry);
+    offset = (offset + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+
+    vector<shared_entry> entries;
+    for (auto &[filename, size]: sizes) {
+        shared_entry entry;
+        memset(entry.name, 0, SHARED_NAME_SIZE);
+        strncpy(entry.name, filename.c_str(), SHARED_NAME_SIZE - 1);
+        entry.offset = offset;
+        entries.push_back(entry);
+
+        offset += (size + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN;
+    }
+
+    /* each region on its own pages, near the client that writes it */
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+
+    char *base;
+    MPI_Win_allocate_shared(offset, 1, info, share.comm, &base, &share.window);
+    MPI_Info_free(&info);
+
+    int count = entries.size();
+    memcpy(base, &count, sizeof(int));
+    memcpy(base + sizeof(int), entries.data(), count * sizeof(shared_entry));
+
+    for (shared_entry &entry: entries) {
+        placed[entry.name] = base + entry.offset;
+    }
+
+    /* the directories are complete before anyone reads them */
+    MPI_Barrier(share.comm);
+}
+
+/* The file in the region of the client with the given world rank, NULL if the client is on another node
+   or does not share the file. The directory is searched on every call, callers keep the result. */
+char *peer_shared_file(node_share &share, int rank, const char *filename) {
+    if (share.local.empty() || !share.local[rank])
+        return NULL;
+
+    MPI_Aint size;
+    int disp_unit;
+    char *base;
+    MPI_Win_shared_query(share.window, share.node_rank[rank], &size, &disp_unit, &base);
+
+    char *file = NULL;
+    int count;
+    memcpy(&count, base, sizeof(int));
+    shared_entry *entries = (shared_entry *)(base + sizeof(int));
+
+    for (int i = 0; i < count; i++) {
+        if (!strncmp(entries[i].name, filename, SHARED_NAME_SIZE)) {
+            file = base + entries[i].offset;
+            break;
+        }
+    }
+
+    return file;
+}
+
+/* Release the window once every client on the node is done reading it. */
+void free_node_share(node_share &share) {
+    if (share.window != MPI_WIN_NULL)
+        MPI_Win_free(&share.window);
+
+    if (share.comm != MPI_COMM_NULL)
+        MPI_Comm_free(&share.comm);
+}
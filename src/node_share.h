@@ -0,0 +1,44 @@
+#ifndef __NODE_SHARE_H__
+#define __NODE_SHARE_H__
+
+#include <mpi.h>
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* room for a filename in the directory of a region, MAX_FILENAME + 1 */
+#define SHARED_NAME_SIZE 16
+/* the files of a region start on page boundaries */
+#define SHARED_ALIGN 4096
+
+/* Where a file starts in the shared region of a client. */
+typedef struct {
+    char name[SHARED_NAME_SIZE];
+    size_t offset;
+} shared_entry;
+
+/* The stores of the clients on this node, in one shared memory window: each client's region starts with
+   a directory of its files (an int count, then a shared_entry per file), written once when the window is
+   allocated and only read afterwards. */
+typedef struct {
+    /* the clients on this node */
+    MPI_Comm comm;
+    MPI_Win window;
+    /* node_rank[world rank] = rank in comm, -1 for the ranks on other nodes and the trackers */
+    vector<int> node_rank;
+    /* local[world rank] = another client on this node, whose segments are copied from shared memory */
+    vector<bool> local;
+} node_share;
+
+void split_node_share(node_share &share, int num_trackers, int rank, int numtasks);
+
+void allocate_node_share(node_share &share, map<string, size_t> &sizes, map<string, char *> &placed);
+
+char *peer_shared_file(node_share &share, int rank, const char *filename);
+
+void free_node_share(node_share &share);
+
+#endif
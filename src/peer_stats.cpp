@@ -0,0 +1,52 @@
+#include "peer_stats.h"
+
+void init_peer_stats(peer_stats &stats, int numtasks) {
+    stats.peers.assign(numtasks, peer_load{0, 0, 0, 0, 0, false});
+    stats.best_rtt = 0;
+}
+
+/* A request for a segment was sent to the peer. */
+void peer_request_sent(peer_stats &stats, int rank) {
+    stats.peers[rank].in_flight++;
+}
+
+/* The peer answered a request: rtt is the round trip of the request (< 0 if it did not bring a segment)
+   and queued the number of requests the peer had waiting when it replied (< 0 if it did not say). */
+void peer_reply_received(peer_stats &stats, int rank, double rtt, int queued) {
+    peer_load &peer = stats.peers[rank];
+
+    peer.in_flight--;
+
+    if (queued >= 0)
+        peer.queued = queued;
+
+    if (rtt < 0)
+        return;
+
+    peer.rtt = peer.rtt == 0 ? rtt : (1 - RTT_WEIGHT) * peer.rtt + RTT_WEIGHT * rtt;
+
+    if (stats.best_rtt == 0 || rtt < stats.best_rtt)
+        stats.best_rtt = rtt;
+}
+
+/* The peer does not serve this client for now. */
+void peer_choked(peer_stats &stats, int rank) {
+    stats.peers[rank].choked = true;
+}
+
+/* Try the peers that choked this client again, once per round with the tracker. */
+void forget_chokes(peer_stats &stats) {
+    for (peer_load &peer: stats.peers) {
+        peer.choked = false;
+    }
+}
+
+/* When a new request to the peer is expected to complete, in seconds from now: one round trip for each
+   request ahead of it, those of this client in flight and those of other clients queued at the peer.
+   Before anything is measured, the round trip counts as one and the requests ahead decide alone. */
+double expected_completion(peer_stats &stats, int rank) {
+    peer_load &peer = stats.peers[rank];
+    double rtt = peer.rtt > 0 ? peer.rtt : stats.best_rtt > 0 ? stats.best_rtt : 1;
+
+    return rtt * (1 + peer.in_flight + peer.queued + peer.penalty);
+}
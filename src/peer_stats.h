@@ -0,0 +1,45 @@
+#ifndef __PEER_STATS_H__
+#define __PEER_STATS_H__
+
+#include <vector>
+
+using namespace std;
+
+/* weight of a new round trip sample in the moving average, as for the smoothed RTT of TCP */
+#define RTT_WEIGHT 0.125
+
+/* What a client measured of a peer it downloads from. */
+typedef struct {
+    /* segments asked from the peer, and those of them not answered yet */
+    int requests;
+    int in_flight;
+    /* requests waiting in the peer's upload queues, as given at the end of its last reply */
+    int queued;
+    /* raised by the caller for each corrupted segment the peer sent, counted like requests ahead */
+    int penalty;
+    /* moving average of the time from a request to its segment in seconds, 0 until the first reply */
+    double rtt;
+    /* the peer answered a request with REPLY_CHOKED (-k), it is not asked again until the next peer list */
+    bool choked;
+} peer_load;
+
+/* The peers of a client, by rank. */
+typedef struct {
+    vector<peer_load> peers;
+    /* the shortest round trip measured, assumed for the peers not measured yet so that they get tried */
+    double best_rtt;
+} peer_stats;
+
+void init_peer_stats(peer_stats &stats, int numtasks);
+
+void peer_request_sent(peer_stats &stats, int rank);
+
+void peer_reply_received(peer_stats &stats, int rank, double rtt, int queued);
+
+void peer_choked(peer_stats &stats, int rank);
+
+void forget_chokes(peer_stats &stats);
+
+double expected_completion(peer_stats &stats, int rank);
+
+#endif
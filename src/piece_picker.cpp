@@ -0,0 +1,284 @@
+#include "piece_picker.h"
+
+#include <stdlib.h>
+#include <algorithm>
+
+/* Bucket of a segment in order. */
+static int bucket_of(piece_picker &picker, int segment) {
+    return picker.picked[segment] ? 0 : picker.availability[segment] + 1;
+}
+
+/* Swap the segments at positions i and j of order. */
+static void swap_positions(piece_picker &picker, int i, int j) {
+    int a = picker.order[i], b = picker.order[j];
+
+    picker.order[i] = b;
+    picker.order[j] = a;
+    picker.position[a] = j;
+    picker.position[b] = i;
+}
+
+static void note_available(piece_picker &picker, int bucket) {
+    if (bucket > 1 && bucket - 1 < picker.lowest)
+        picker.lowest = bucket - 1;
+}
+
+/* Move the segment from bucket b to bucket b + 1: it becomes the last of b, whose end moves down by one. */
+static void move_up(piece_picker &picker, int segment, int b) {
+    if (b + 2 >= (int)picker.start.size())
+        picker.start.push_back(picker.num_segments);
+
+    swap_positions(picker, picker.position[segment], picker.start[b + 1] - 1);
+    picker.start[b + 1]--;
+
+    note_available(picker, b + 1);
+}
+
+/* Move the segment from bucket b to bucket b - 1: it becomes the first of b, whose start moves up by one. */
+static void move_down(piece_picker &picker, int segment, int b) {
+    swap_positions(picker, picker.position[segment], picker.start[b]);
+    picker.start[b]++;
+
+    note_available(picker, b - 1);
+}
+
+/* The peer is used as a source of segment: move the segment one bucket up. */
+static void add_holder(piece_picker &picker, int segment) {
+    if (!picker.picked[segment])
+        move_up(picker, segment, bucket_of(picker, segment));
+
+    picker.availability[segment]++;
+}
+
+/* The known bitfield of the peer, adding a row of zeros for a new peer. The pointer is valid until the
+   next peer is added. */
+static uint64_t *known_bits(piece_picker &picker, int rank) {
+    int words = bitfield_words(picker.num_segments);
+
+    if (rank >= (int)picker.row.size())
+        picker.row.resize(rank + 1, -1);
+
+    if (picker.row[rank] == -1) {
+        picker.row[rank] = picker.peers.size();
+        picker.peers.push_back(rank);
+        picker.known_words.resize(picker.known_words.size() + words, 0);
+        picker.rejected_words.resize(picker.rejected_words.size() + words, 0);
+    }
+
+    return &picker.known_words[(size_t)picker.row[rank] * words];
+}
+
+/* Start tracking a file with num_segments segments, none of them owned or available yet, in a swarm of
+   at most num_peers ranks. Room is made for the bitfield of every peer, which the client ends up knowing
+   as the peers join the swarm. */
+void init_picker(piece_picker &picker, int num_segments, int num_peers, unsigned int seed) {
+    picker.num_segments = num_segments;
+    picker.num_picked = 0;
+    picker.seed = seed;
+    picker.availability.assign(num_segments, 0);
+    picker.order.resize(num_segments);
+    picker.position.resize(num_segments);
+    picker.picked.assign(num_segments, false);
+    picker.lowest = 1;
+    picker.known_words.clear();
+    picker.known_words.reserve((size_t)num_peers * bitfield_words(num_segments));
+    picker.row.assign(num_peers, -1);
+    picker.peers.clear();
+    picker.peers.reserve(num_peers);
+    picker.rejected_words.clear();
+    picker.rejected_words.reserve((size_t)num_peers * bitfield_words(num_segments));
+
+    /* every segment starts in bucket 1, held by nobody */
+    for (int s = 0; s < num_segments; s++) {
+        picker.order[s] = s;
+        picker.position[s] = s;
+    }
+    picker.start = {0, 0, num_segments};
+    picker.start.reserve(num_peers + 2);
+}
+
+/* Record that the peer with the given rank holds segment, moving the segment one bucket up.
+   Returns false if this was already known. */
+bool picker_add_have(piece_picker &picker, int rank, int segment) {
+    if (segment < 0 || segment >= picker.num_segments)
+        return false;
+
+    uint64_t *known = known_bits(picker, rank);
+    uint64_t mask = (uint64_t)1 << (segment % 64);
+
+    if (known[segment / 64] & mask)
+        return false;
+
+    known[segment / 64] |= mask;
+    add_holder(picker, segment);
+
+    return true;
+}
+
+/* Record every segment set in words, the bitfield words first_word .. first_word + num_words - 1 of the
+   peer, looking only at the bits that are new. Returns the number of segments added. */
+int picker_add_bitfield(piece_picker &picker, int rank, int first_word, const uint64_t *words, int num_words) {
+    uint64_t *known = known_bits(picker, rank);
+
+    int added = 0;
+    int last_word = min(first_word + num_words, bitfield_words(picker.num_segments));
+
+    for (int w = max(first_word, 0); w < last_word; w++) {
+        uint64_t fresh = words[w - first_word] & ~known[w] & bitfield_word_mask(picker.num_segments, w);
+        known[w] |= fresh;
+
+        for (; fresh; fresh &= fresh - 1) {
+            add_holder(picker, w * 64 + __builtin_ctzll(fresh));
+            added++;
+        }
+    }
+
+    return added;
+}
+
+/* Stop using the peer as a source of segment. Its bit stays set in its known bitfield, so peer lists that
+   still report the segment do not add it back. The last source of a segment is never removed: the
+   rejections of the segment expire instead, every holder is a source again and only the penalties of the
+   peers that sent bad copies keep find_peer away from them, so that one bad copy does not make the segment
+   unobtainable. */
+void picker_remove_holder(piece_picker &picker, int rank, int segment) {
+    if (!picker_is_holder(picker, rank, segment))
+        return;
+
+    int words = bitfield_words(picker.num_segments);
+    uint64_t mask = (uint64_t)1 << (segment % 64);
+
+    if (picker.availability[segment] > 1) {
+        picker.rejected_words[(size_t)picker.row[rank] * words + segment / 64] |= mask;
+
+        if (!picker.picked[segment])
+            move_down(picker, segment, bucket_of(picker, segment));
+
+        picker.availability[segment]--;
+        return;
+    }
+
+    for (size_t w = segment / 64; w < picker.rejected_words.size(); w += words) {
+        if (picker.rejected_words[w] & mask) {
+            picker.rejected_words[w] &= ~mask;
+            add_holder(picker, segment);
+        }
+    }
+}
+
+/* Move the segment down to bucket 0, one bucket at a time. */
+static void mark_picked(piece_picker &picker, int segment) {
+    for (int b = bucket_of(picker, segment); b > 0; b--) {
+        move_down(picker, segment, b);
+    }
+
+    picker.picked[segment] = true;
+}
+
+/* Pick the next segment to request and remove it from the candidates: a random available segment
+   for the first RANDOM_FIRST_PIECES picks, so a new downloader quickly has something to share,
+   then one of the rarest segments. Returns -1 if no candidate is held by any peer. */
+int pick_segment(piece_picker &picker) {
+    int segment = -1;
+
+    if (picker.num_picked < RANDOM_FIRST_PIECES) {
+        for (int tries = 0; tries < 8 && segment == -1; tries++) {
+            int s = rand_r(&picker.seed) % picker.num_segments;
+
+            if (!picker.picked[s] && picker.availability[s] > 0)
+                segment = s;
+        }
+    }
+
+    if (segment == -1) {
+        /* skip the empty buckets, they stay empty until a segment moves into them */
+        int num_buckets = picker.start.size() - 1;
+
+        while (picker.lowest + 1 < num_buckets && picker.start[picker.lowest + 1] == picker.start[picker.lowest + 2])
+            picker.lowest++;
+
+        if (picker.lowest + 1 >= num_buckets)
+            return -1;
+
+        /* break ties at random so that downloaders do not all chase the same segment */
+        int first = picker.start[picker.lowest + 1];
+        int size = picker.start[picker.lowest + 2] - first;
+        segment = picker.order[first + rand_r(&picker.seed) % size];
+    }
+
+    mark_picked(picker, segment);
+    picker.num_picked++;
+
+    return segment;
+}
+
+/* Put back a segment whose request failed, so it can be picked again. */
+void unpick_segment(piece_picker &picker, int segment) {
+    if (!picker.picked[segment])
+        return;
+
+    picker.picked[segment] = false;
+
+    for (int b = 0; b <= picker.availability[segment]; b++) {
+        move_up(picker, segment, b);
+    }
+}
+
+/* The segment was received: it is no longer a candidate, even if a failed duplicate request put it back. */
+void picker_segment_done(piece_picker &picker, int segment) {
+    if (!picker.picked[segment])
+        mark_picked(picker, segment);
+}
+
+/* Finds rank of a peer from which to request the segment: the holder expected to deliver it first
+(see expected_completion), the one with the fewest requests sent from current client among equals. The
+holders are scanned from a random one, so that clients that know as little of the swarm do not all pick
+the same peer. Holders on the same node (local[rank], empty if unknown) come first, the least used of them
+is chosen. Holders that choke the client are left out. Returns -1 if no other peer is known to hold the
+segment. */
+int find_peer(piece_picker &picker, int segment, peer_stats &load, const vector<bool> &local) {
+    if (picker.availability[segment] == 0)
+        return -1;
+
+    vector<peer_load> &peers = load.peers;
+
+    if (!local.empty()) {
+        int nearest = -1;
+        for (int holder: picker.peers) {
+            if (local[holder] && !peers[holder].choked && picker_is_holder(picker, holder, segment) &&
+                (nearest == -1 || peers[holder].requests < peers[nearest].requests))
+                nearest = holder;
+        }
+
+        if (nearest != -1) {
+            peers[nearest].requests++;
+            return nearest;
+        }
+    }
+
+    int num_peers = picker.peers.size();
+    int first = rand_r(&picker.seed) % num_peers;
+    int peer_rank = -1;
+    double best = 0;
+
+    for (int i = 0; i < num_peers; i++) {
+        int holder = picker.peers[(first + i) % num_peers];
+        if (peers[holder].choked || !picker_is_holder(picker, holder, segment))
+            continue;
+
+        double expected = expected_completion(load, holder);
+        if (peer_rank == -1 || expected < best ||
+            (expected == best && peers[holder].requests < peers[peer_rank].requests)) {
+            peer_rank = holder;
+            best = expected;
+        }
+    }
+
+    if (peer_rank == -1)
+        return -1;
+
+    /* update number of requests sent to the peer */
+    peers[peer_rank].requests++;
+
+    return peer_rank;
+}
@@ -0,0 +1,81 @@
+#ifndef __PIECE_PICKER_H__
+#define __PIECE_PICKER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "bitfield.h"
+#include "peer_stats.h"
+
+using namespace std;
+
+/* the first RANDOM_FIRST_PIECES segments of a download are picked at random, the rest rarest-first */
+#define RANDOM_FIRST_PIECES 4
+
+/* Segment selection state of a file the client is downloading. Everything lives in flat arrays sized for
+   the whole swarm when the picker starts, so that picking segments and merging peer lists allocates
+   nothing afterwards. */
+typedef struct {
+    int num_segments;
+    int num_picked;
+    unsigned int seed;
+    /* availability[s] = number of peers known to hold segment s and still used as its source */
+    vector<int> availability;
+    /* the segments ordered by bucket: bucket 0 holds the picked segments, bucket a + 1 the segments not
+       picked yet that a peers hold. Bucket b is order[start[b] .. start[b + 1]), position[s] = index of s
+       in order, so a segment changes bucket with one swap */
+    vector<int> order;
+    vector<int> position;
+    vector<int> start;
+    vector<bool> picked;
+    /* no bucket with availability in [1, lowest) holds a segment */
+    int lowest;
+    /* the segments each peer is known to hold: row[rank] = the index of the peer's bitfield among the rows
+       of bitfield_words(num_segments) words of known_words, -1 if there is none; peers = the ranks with a row */
+    vector<uint64_t> known_words;
+    vector<int> row;
+    vector<int> peers;
+    /* the same rows for the segments each peer is no longer used as a source of (see picker_remove_holder) */
+    vector<uint64_t> rejected_words;
+} piece_picker;
+
+/* Whether anything is known of the segments the peer holds. */
+static inline bool picker_knows_peer(const piece_picker &picker, int rank) {
+    return rank < (int)picker.row.size() && picker.row[rank] != -1;
+}
+
+/* Whether the peer is known to hold the segment. */
+static inline bool picker_knows(const piece_picker &picker, int rank, int segment) {
+    if (!picker_knows_peer(picker, rank))
+        return false;
+
+    const uint64_t *bits = &picker.known_words[(size_t)picker.row[rank] * bitfield_words(picker.num_segments)];
+    return (bits[segment / 64] >> (segment % 64)) & 1;
+}
+
+/* Whether the peer holds the segment and is still used as its source. */
+static inline bool picker_is_holder(const piece_picker &picker, int rank, int segment) {
+    if (!picker_knows(picker, rank, segment))
+        return false;
+
+    size_t word = (size_t)picker.row[rank] * bitfield_words(picker.num_segments) + segment / 64;
+    return !((picker.rejected_words[word] >> (segment % 64)) & 1);
+}
+
+void init_picker(piece_picker &picker, int num_segments, int num_peers, unsigned int seed);
+
+bool picker_add_have(piece_picker &picker, int rank, int segment);
+
+int picker_add_bitfield(piece_picker &picker, int rank, int first_word, const uint64_t *words, int num_words);
+
+void picker_remove_holder(piece_picker &picker, int rank, int segment);
+
+int pick_segment(piece_picker &picker);
+
+void unpick_segment(piece_picker &picker, int segment);
+
+void picker_segment_done(piece_picker &picker, int segment);
+
+int find_peer(piece_picker &picker, int segment, peer_stats &load, const vector<bool> &local);
+
+#endif
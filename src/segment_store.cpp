@@ -0,0 +1,162 @@
+#include "segment_store.h"
+#include "bitfield.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char *map_or_exit(size_t size, int prot, int flags, int fd) {
+    void *data = mmap(NULL, size > 0 ? size : 1, prot, flags, fd, 0);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+
+    return (char *)data;
+}
+
+/* Map the data of a seeded file. If the file at path holds all the segments, it is mapped read-only
+   and uploads are sent straight from the page cache. Otherwise the segments are read into anonymous
+   memory. Returns the number of segments read from the file; the caller fills in the rest. */
+int open_seed_store(segment_store &store, const char *path, int num_segments, int segment_size) {
+    store.size = (size_t)num_segments * segment_size;
+    store.segment_size = segment_size;
+    store.fd = -1;
+    store.state.data = NULL;
+
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size >= store.size) {
+        store.data = map_or_exit(store.size, PROT_READ, MAP_SHARED, fd);
+        close(fd);
+        return num_segments;
+    }
+
+    store.data = map_or_exit(store.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+
+    int complete = 0;
+    if (fd != -1) {
+        ssize_t r = pread(fd, store.data, store.size, 0);
+        complete = r > 0 ? r / segment_size : 0;
+        close(fd);
+    }
+
+    return complete;
+}
+
+/* Create the output file of a download at its final size, its blocks allocated up front so that the
+   segments written out of order do not fragment it. */
+static int open_output_file(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        perror(path);
+        exit(-1);
+    }
+
+    /* not every file system can allocate ahead, the file is then filled as it is written */
+    if (size > 0)
+        fallocate(fd, 0, 0, size);
+
+    return fd;
+}
+
+/* Create the output file of a download and the memory its segments are received in. The segments are
+   written to the file by the disk writer as they are verified. */
+void create_output_store(segment_store &store, const char *path, int num_segments, int segment_size) {
+    store.size = (size_t)num_segments * segment_size;
+    store.segment_size = segment_size;
+    store.fd = open_output_file(path, store.size);
+    store.data = map_or_exit(store.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+    store.state.data = NULL;
+    store.held.assign(bitfield_words(num_segments), 0);
+}
+
+/* Open the output file of an interrupted download and read what it holds into memory, where the download
+   goes on. Returns false if there is no such file at the size of the download. */
+bool resume_output_store(segment_store &store, const char *path, int num_segments, int segment_size) {
+    struct stat st;
+
+    store.size = (size_t)num_segments * segment_size;
+    store.segment_size = segment_size;
+    store.state.data = NULL;
+    store.held.assign(bitfield_words(num_segments), 0);
+
+    store.fd = open(path, O_RDWR);
+    if (store.fd == -1)
+        return false;
+
+    if (fstat(store.fd, &st) == -1 || (size_t)st.st_size != store.size) {
+        close(store.fd);
+        return false;
+    }
+
+    store.data = map_or_exit(store.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+
+    for (size_t done = 0; done < store.size; ) {
+        ssize_t r = pread(store.fd, store.data + done, store.size - done, done);
+        if (r <= 0) {
+            perror(path);
+            exit(-1);
+        }
+        done += r;
+    }
+
+    return true;
+}
+
+/* Create the output file of a download whose segments are received in data, memory shared with the
+   other clients of the node. */
+void create_shared_output_store(segment_store &store, char *data, const char *path, int num_segments, int segment_size) {
+    store.size = (size_t)num_segments * segment_size;
+    store.segment_size = segment_size;
+    store.fd = open_output_file(path, store.size);
+    store.data = data;
+    store.state.data = NULL;
+    store.held.assign(bitfield_words(num_segments), 0);
+}
+
+/* Move the contents of a seeded or resumed file to data, memory shared with the other clients of the node. */
+void move_seed_store(segment_store &store, char *data) {
+    memcpy(data, store.data, store.size);
+    munmap(store.data, store.size > 0 ? store.size : 1);
+
+    store.data = data;
+}
+
+/* Every segment of the download was written to the output file, flush it to disk, then its checkpoint.
+   The data stays in memory so the segments can still be uploaded to other peers. */
+void finish_output_store(segment_store &store) {
+    if (fsync(store.fd) == -1)
+        perror("fsync");
+
+    if (store.state.data)
+        sync_checkpoint(store.state);
+}
+
+/* Contents of a segment of a seeded file that has no data on disk: bytes derived from its hash. */
+void fill_synthetic_segment(char *segment, const char *hash, int hash_size, int segment_size) {
+    uint64_t x = 1469598103934665603ULL;
+
+    for (int i = 0; i < hash_size && hash[i]; i++) {
+        x = (x ^ (unsigned char)hash[i]) * 1099511628211ULL;
+    }
+
+    for (int i = 0; i < segment_size; i += sizeof(uint64_t)) {
+        /* xorshift64* */
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        uint64_t v = x * 2685821657736338717ULL;
+
+        for (int b = 0; b < (int)sizeof(uint64_t) && i + b < segment_size; b++) {
+            segment[i + b] = (char)(v >> (8 * b));
+        }
+    }
+}
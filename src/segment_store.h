@@ -0,0 +1,60 @@
+#ifndef __SEGMENT_STORE_H__
+#define __SEGMENT_STORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "checkpoint.h"
+
+using namespace std;
+
+/* segment size used when none is given with -s */
+#define SEGMENT_SIZE 16384
+
+/* The contents of a file, num_segments * segment_size bytes in memory. */
+typedef struct {
+    char *data;
+    size_t size;
+    int segment_size;
+    /* the output file the segments are written to, -1 for a seeded file */
+    int fd;
+    /* which segments of the download reached the output file, state.data is NULL for a seeded file */
+    checkpoint state;
+    /* which segments of a download are in data and verified, a bit per segment; empty for a seeded file,
+       which holds them all. Set by the download thread, read by the upload workers */
+    vector<uint64_t> held;
+} segment_store;
+
+int open_seed_store(segment_store &store, const char *path, int num_segments, int segment_size);
+
+void create_output_store(segment_store &store, const char *path, int num_segments, int segment_size);
+
+bool resume_output_store(segment_store &store, const char *path, int num_segments, int segment_size);
+
+void create_shared_output_store(segment_store &store, char *data, const char *path, int num_segments, int segment_size);
+
+void move_seed_store(segment_store &store, char *data);
+
+void finish_output_store(segment_store &store);
+
+void fill_synthetic_segment(char *segment, const char *hash, int hash_size, int segment_size);
+
+static inline char *segment_data(segment_store &store, int segment) {
+    return store.data + (size_t)segment * store.segment_size;
+}
+
+/* The segment was copied to data and verified: it can be uploaded from now on. */
+static inline void store_segment_held(segment_store &store, int segment) {
+    __atomic_fetch_or(&store.held[segment / 64], (uint64_t)1 << (segment % 64), __ATOMIC_RELEASE);
+}
+
+/* Whether the segment can be uploaded from the store. */
+static inline bool store_holds(segment_store &store, int segment) {
+    if (store.held.empty())
+        return true;
+
+    return (__atomic_load_n(&store.held[segment / 64], __ATOMIC_ACQUIRE) >> (segment % 64)) & 1;
+}
+
+#endif
@@ -0,0 +1,222 @@
+#include "sha256.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t load_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void store_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/* Build the padded last block(s) of a len byte message in tail, returns their number (1 or 2). */
+static int sha256_tail(unsigned char *tail, const unsigned char *data, size_t len) {
+    size_t rem = len % 64;
+    int blocks = rem < 56 ? 1 : 2;
+
+    memset(tail, 0, 128);
+    memcpy(tail, data + len - rem, rem);
+    tail[rem] = 0x80;
+
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[blocks * 64 - 1 - i] = bits >> (8 * i);
+    }
+
+    return blocks;
+}
+
+static void sha256_block(uint32_t *s, const unsigned char *block) {
+    uint32_t w[64];
+
+    for (int t = 0; t < 16; t++) {
+        w[t] = load_be32(block + 4 * t);
+    }
+    for (int t = 16; t < 64; t++) {
+        uint32_t s0 = rotr(w[t-15], 7) ^ rotr(w[t-15], 18) ^ (w[t-15] >> 3);
+        uint32_t s1 = rotr(w[t-2], 17) ^ rotr(w[t-2], 19) ^ (w[t-2] >> 10);
+        w[t] = w[t-16] + s0 + w[t-7] + s1;
+    }
+
+    uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+    for (int t = 0; t < 64; t++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+/* Scalar SHA-256 of a single buffer. */
+void sha256(const unsigned char *data, size_t len, unsigned char *digest) {
+    uint32_t s[8];
+    unsigned char tail[128];
+
+    memcpy(s, H0, sizeof(s));
+
+    for (size_t b = 0; b < len / 64; b++) {
+        sha256_block(s, data + b * 64);
+    }
+
+    int tail_blocks = sha256_tail(tail, data, len);
+    for (int b = 0; b < tail_blocks; b++) {
+        sha256_block(s, tail + b * 64);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, s[i]);
+    }
+}
+
+#ifdef SHA256_X86
+
+/* Multi-buffer kernels: lane i of every vector works on buffer i, so one pass of the compression
+   function hashes a block of 4 (SSE2) or 8 (AVX2) buffers of the same length. The round functions
+   are the scalar ones written with vector operations. */
+#define SHA256_LANES_BODY(V, LANES, ADD, XOR, AND, ANDNOT, OR, SRL, SLL, SET1, LOAD, STORE)           \
+    static inline V ROTR(V x, int n) {                                                               \
+        return OR(SRL(x, n), SLL(x, 32 - n));                                                        \
+    }                                                                                                \
+                                                                                                     \
+    static void block(V *s, const unsigned char *const *blocks) {                                    \
+        V w[64];                                                                                     \
+        alignas(32) uint32_t lane_words[LANES];                                                      \
+                                                                                                     \
+        for (int t = 0; t < 16; t++) {                                                               \
+            for (int l = 0; l < LANES; l++)                                                          \
+                lane_words[l] = load_be32(blocks[l] + 4 * t);                                        \
+            w[t] = LOAD((V *)lane_words);                                                            \
+        }                                                                                            \
+        for (int t = 16; t < 64; t++) {                                                              \
+            V s0 = XOR(XOR(ROTR(w[t-15], 7), ROTR(w[t-15], 18)), SRL(w[t-15], 3));                   \
+            V s1 = XOR(XOR(ROTR(w[t-2], 17), ROTR(w[t-2], 19)), SRL(w[t-2], 10));                    \
+            w[t] = ADD(ADD(w[t-16], s0), ADD(w[t-7], s1));                                           \
+        }                                                                                            \
+                                                                                                     \
+        V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];            \
+                                                                                                     \
+        for (int t = 0; t < 64; t++) {                                                               \
+            V bs1 = XOR(XOR(ROTR(e, 6), ROTR(e, 11)), ROTR(e, 25));                                  \
+            V ch = XOR(AND(e, f), ANDNOT(e, g));                                                     \
+            V t1 = ADD(ADD(ADD(h, bs1), ADD(ch, SET1(K[t]))), w[t]);                                 \
+            V bs0 = XOR(XOR(ROTR(a, 2), ROTR(a, 13)), ROTR(a, 22));                                  \
+            V maj = XOR(XOR(AND(a, b), AND(a, c)), AND(b, c));                                       \
+            V t2 = ADD(bs0, maj);                                                                    \
+            h = g; g = f; f = e; e = ADD(d, t1);                                                     \
+            d = c; c = b; b = a; a = ADD(t1, t2);                                                    \
+        }                                                                                            \
+                                                                                                     \
+        s[0] = ADD(s[0], a); s[1] = ADD(s[1], b); s[2] = ADD(s[2], c); s[3] = ADD(s[3], d);          \
+        s[4] = ADD(s[4], e); s[5] = ADD(s[5], f); s[6] = ADD(s[6], g); s[7] = ADD(s[7], h);          \
+    }                                                                                                \
+                                                                                                     \
+    static void hash(const unsigned char *const *data, size_t len, unsigned char (*digests)[32]) {   \
+        V s[8];                                                                                      \
+        unsigned char tail[LANES][128];                                                              \
+        const unsigned char *blocks[LANES];                                                          \
+        int tail_blocks = 0;                                                                         \
+                                                                                                     \
+        for (int i = 0; i < 8; i++)                                                                  \
+            s[i] = SET1(H0[i]);                                                                      \
+        for (int l = 0; l < LANES; l++)                                                              \
+            tail_blocks = sha256_tail(tail[l], data[l], len);                                        \
+                                                                                                     \
+        for (size_t n = 0; n < len / 64; n++) {                                                      \
+            for (int l = 0; l < LANES; l++)                                                          \
+                blocks[l] = data[l] + n * 64;                                                        \
+            block(s, blocks);                                                                        \
+        }                                                                                            \
+        for (int n = 0; n < tail_blocks; n++) {                                                      \
+            for (int l = 0; l < LANES; l++)                                                          \
+                blocks[l] = tail[l] + n * 64;                                                        \
+            block(s, blocks);                                                                        \
+        }                                                                                            \
+                                                                                                     \
+        alignas(32) uint32_t lane_words[LANES];                                                      \
+        for (int i = 0; i < 8; i++) {                                                                \
+            STORE((V *)lane_words, s[i]);                                                            \
+            for (int l = 0; l < LANES; l++)                                                          \
+                store_be32(digests[l] + 4 * i, lane_words[l]);                                       \
+        }                                                                                            \
+    }
+
+namespace sse2 {
+    SHA256_LANES_BODY(__m128i, 4, _mm_add_epi32, _mm_xor_si128, _mm_and_si128, _mm_andnot_si128,
+                      _mm_or_si128, _mm_srli_epi32, _mm_slli_epi32, _mm_set1_epi32,
+                      _mm_load_si128, _mm_store_si128)
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+    SHA256_LANES_BODY(__m256i, 8, _mm256_add_epi32, _mm256_xor_si256, _mm256_and_si256, _mm256_andnot_si256,
+                      _mm256_or_si256, _mm256_srli_epi32, _mm256_slli_epi32, _mm256_set1_epi32,
+                      _mm256_load_si256, _mm256_store_si256)
+}
+#pragma GCC pop_options
+
+#endif
+
+/* Number of buffers the fastest kernel of this CPU hashes at once: 8 with AVX2, 4 with SSE2, else 1. */
+int sha256_best_lanes() {
+#ifdef SHA256_X86
+    if (__builtin_cpu_supports("avx2"))
+        return 8;
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+/* Hash n buffers of len bytes each: digests[i] = SHA-256 of data[i]. Buffers are hashed lanes at a time
+   (8, 4 or 1, at most sha256_best_lanes()); a partial group uses the next narrower kernel. */
+void sha256_multi(const unsigned char *const *data, int n, size_t len, unsigned char (*digests)[SHA256_DIGEST_SIZE], int lanes) {
+    int i = 0;
+
+#ifdef SHA256_X86
+    if (lanes >= 8) {
+        for (; i + 8 <= n; i += 8)
+            avx2::hash(data + i, len, digests + i);
+    }
+    if (lanes >= 4) {
+        for (; i + 4 <= n; i += 4)
+            sse2::hash(data + i, len, digests + i);
+    }
+#endif
+
+    for (; i < n; i++)
+        sha256(data[i], len, digests[i]);
+}
@@ -0,0 +1,17 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+/* most buffers hashed at once by sha256_multi */
+#define SHA256_MAX_LANES 8
+
+void sha256(const unsigned char *data, size_t len, unsigned char *digest);
+
+int sha256_best_lanes();
+
+void sha256_multi(const unsigned char *const *data, int n, size_t len, unsigned char (*digests)[SHA256_DIGEST_SIZE], int lanes);
+
+#endif
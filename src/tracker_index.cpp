@@ -0,0 +1,83 @@
+#include "utils.h"
+
+/* Returns the id of the file with the given name, or -1 if the tracker does not know it. */
+int find_file(tracker_index &index, const char *filename) {
+    auto it = index.ids.find(filename);
+
+    return it == index.ids.end() ? -1 : it->second;
+}
+
+/* Returns the id of the file with the given name, adding an empty entry for it if needed. */
+int intern_file(tracker_index &index, const char *filename) {
+    auto [it, inserted] = index.ids.try_emplace(filename, index.files.size());
+
+    if (inserted) {
+        tracker_file file;
+        file.name = filename;
+        file.num_segments = 0;
+        file.version = 0;
+
+        index.files.push_back(file);
+
+        index.locks.emplace_back();
+        pthread_rwlock_init(&index.locks.back(), NULL);
+    }
+
+    return it->second;
+}
+
+/* Returns the entry of the peer with the given rank in the swarm of the file, adding it if needed. */
+file_peer &get_file_peer(tracker_file &file, int rank) {
+    if (rank >= (int)file.peer_slot.size())
+        file.peer_slot.resize(rank + 1, -1);
+
+    if (file.peer_slot[rank] == -1) {
+        file_peer peer;
+        peer.rank = rank;
+        peer.num_owned = 0;
+        peer.bits.assign(bitfield_words(file.num_segments), 0);
+        peer.version = 0;
+        peer.word_version.assign(peer.bits.size(), 0);
+
+        file.peer_slot[rank] = file.peers.size();
+        file.peers.push_back(peer);
+    }
+
+    return file.peers[file.peer_slot[rank]];
+}
+
+/* Store the number of segments and their hashes, the first time a seed reports the file. */
+void set_file_info(tracker_file &file, int num_segments, const char *hashes) {
+    if (file.num_segments >= num_segments)
+        return;
+
+    file.num_segments = num_segments;
+    file.hashes.assign(hashes, hashes + (size_t)num_segments * HASH_SIZE);
+
+    for (file_peer &peer: file.peers) {
+        peer.bits.resize(bitfield_words(num_segments), 0);
+        peer.word_version.resize(peer.bits.size(), 0);
+    }
+}
+
+/* Mark every segment set in words, which hold the bitfield words first_word .. first_word + num_words - 1,
+   as owned by the peer. All the changed words get the same new version. */
+void add_peer_bits(tracker_file &file, int rank, int first_word, const uint64_t *words, int num_words) {
+    file_peer &peer = get_file_peer(file, rank);
+    int version = file.version + 1;
+
+    for (int i = 0; i < num_words; i++) {
+        int w = first_word + i;
+        if (w < 0 || w >= (int)peer.bits.size())
+            continue;
+
+        uint64_t added = words[i] & ~peer.bits[w] & bitfield_word_mask(file.num_segments, w);
+
+        if (!added)
+            continue;
+
+        peer.bits[w] |= added;
+        peer.num_owned += __builtin_popcountll(added);
+        peer.version = peer.word_version[w] = file.version = version;
+    }
+}
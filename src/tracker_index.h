@@ -0,0 +1,58 @@
+#ifndef __TRACKER_INDEX_H__
+#define __TRACKER_INDEX_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bitfield.h"
+
+using namespace std;
+
+/* Segments of a file owned by one peer. */
+typedef struct {
+    int rank;
+    int num_owned;
+    vector<uint64_t> bits;
+    /* version of the file when the peer last changed, and when each word of bits last changed */
+    int version;
+    vector<int> word_version;
+} file_peer;
+
+typedef struct {
+    string name;
+    int num_segments;
+    /* num_segments * HASH_SIZE bytes, the hash of each segment stored once */
+    vector<char> hashes;
+    /* the swarm of the file, in the order the peers joined it */
+    vector<file_peer> peers;
+    /* peer_slot[rank] = index of the peer in peers, or -1 */
+    vector<int> peer_slot;
+    /* incremented on every change to the swarm; peer lists only hold what changed since the version
+       the client last saw */
+    int version;
+} tracker_file;
+
+/* Files are interned: the name is looked up once per message, everything else is indexed by file id.
+   Files are only added while the tracker starts; afterwards the swarm of each file is read and updated
+   concurrently by the tracker workers, under locks[file_id] (a deque, so locks never move). */
+typedef struct {
+    unordered_map<string, int> ids;
+    vector<tracker_file> files;
+    deque<pthread_rwlock_t> locks;
+} tracker_index;
+
+int find_file(tracker_index &index, const char *filename);
+
+int intern_file(tracker_index &index, const char *filename);
+
+file_peer &get_file_peer(tracker_file &file, int rank);
+
+void set_file_info(tracker_file &file, int num_segments, const char *hashes);
+
+void add_peer_bits(tracker_file &file, int rank, int first_word, const uint64_t *words, int num_words);
+
+#endif
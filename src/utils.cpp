@@ -1,284 +1,707 @@
 #include "utils.h"
 
-/* Parse initial message from the client and add all the files information to the tracker map. */
-void add_files_to_map(char *data, int rank, map<string, map<int, vector<segment_info>>> &tracker_map) {
+/* Manifest format (from client to tracker shard, gathered at startup):
+size(bytes):  sizeof(int)  | sizeof(int) + len | sizeof(int)  | num_segments * HASH_SIZE | ...
+             N = num files |     filename      | num_segments |      segment hashes      | ... (N times)
+Only the files the client seeds are listed, it owns every segment of them. */
+void put_manifest_file(vector<char> &data, const char *filename, int num_segments, const char *hashes) {
+    put_string(data, filename);
+    put_int(data, num_segments);
+    put_bytes(data, hashes, (size_t)num_segments * HASH_SIZE);
+}
+
+/* Parse the manifest of a client and add the files it seeds to the tracker index. */
+void add_files_to_index(const char *data, int rank, tracker_index &swarms) {
     char filename[MAX_FILENAME+1] = {0};
-    char hash[HASH_SIZE+1] = {0};
+    vector<uint64_t> owned;
 
-    int num_files = *(int *)data;
-    int offset = sizeof(int);
+    int offset = 0;
+    int num_files = get_int(data, offset);
 
     int num_segments;
-    segment_info segment;
 
     for (int i = 0; i < num_files; i++) {
         /* get the filename and number of segments of the file */
-        strncpy(filename, data + offset, MAX_FILENAME+1);
-        offset += MAX_FILENAME+1;
+        get_string(data, offset, filename, MAX_FILENAME);
+        num_segments = get_int(data, offset);
 
-        num_segments = *(int *)(data + offset);
-        offset += sizeof(int);
+        int file_id = intern_file(swarms, filename);
+        tracker_file &file = swarms.files[file_id];
 
-        /* store hash and segment number for each segment of the file in tracker_map */
-        for (int j = 0; j < num_segments; j++) {
-            strncpy(hash, data + offset, HASH_SIZE+1);
-            offset += HASH_SIZE+1;
+        /* the hashes are stored once per file, the client is added to the swarm with all the segments */
+        pthread_rwlock_wrlock(&swarms.locks[file_id]);
 
-            segment.seg_no = j;
-            strncpy(segment.hash, hash, HASH_SIZE+1);
+        set_file_info(file, num_segments, data + offset);
+        offset += num_segments * HASH_SIZE;
 
-            tracker_map[filename][rank].push_back(segment);
-        }
+        bitfield_fill(owned, num_segments);
+        add_peer_bits(file, rank, 0, owned.data(), owned.size());
+
+        pthread_rwlock_unlock(&swarms.locks[file_id]);
     }
 }
 
 /* Request format (from client to client):
-size(bytes):  MAX_FILENAME  |   HASH_SIZE
-               filename     |  segment hash  */
-void send_file_request(const char *filename, char *hash, int dest) {
-    char data[MAX_MESSAGE_LEN] = {0};
+size(bytes):  sizeof(int) + len | sizeof(int) |  HASH_SIZE   | sizeof(int)
+                  filename      |   segment   | segment hash |  reply tag
+The request is sent without blocking from data, which must be kept until the request completes. */
+void send_file_request(const char *filename, const char *hash, int segment, int dest, int reply_tag, vector<char> &data, MPI_Request *request) {
+    data.clear();
+
+    put_string(data, filename);
+    put_int(data, segment);
+    put_bytes(data, hash, HASH_SIZE);
+    put_int(data, reply_tag);
+
+    isend_message(data, dest, TAG_REQUEST, request);
+}
 
-    strncpy(data, filename, MAX_FILENAME+1);
-    strncpy(data + MAX_FILENAME+1, hash, HASH_SIZE+1);
+/* Get the filename, segment number and reply tag from a request sent by send_file_request. */
+void parse_file_request(const char *data, char *filename, int *segment, int *reply_tag) {
+    int offset = 0;
 
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, dest, TAG_REQUEST, MPI_COMM_WORLD);
+    get_string(data, offset, filename, MAX_FILENAME);
+    *segment = get_int(data, offset);
+    offset += HASH_SIZE;
+    *reply_tag = get_int(data, offset);
 }
 
-/* Message from client to the tracker informing download finished for file with filename. */
-void send_file_downloaded(const char *filename) {
-    char data[MAX_MESSAGE_LEN+1] = {0};
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_FILE_DOWNLOADED, MPI_COMM_WORLD);
+/* Cancel format (from client to client):
+size(bytes):  sizeof(int) + len | sizeof(int) | sizeof(int)
+                  filename      |   segment   |  reply tag
+The request sent with reply_tag is no longer needed; if it is still queued, the peer replies with an empty
+message instead of the segment. */
+void send_cancel(const char *filename, int segment, int reply_tag, int dest, vector<char> &data) {
+    data.clear();
+
+    put_string(data, filename);
+    put_int(data, segment);
+    put_int(data, reply_tag);
+
+    send_message(data, dest, TAG_CANCEL);
 }
 
-/* Update tracker_map with data received from the client. */
-void parse_update(char *data, int source, map<string, map<int, vector<segment_info>>> &tracker_map) {
-    char filename[MAX_FILENAME+1];
-    char hash[HASH_SIZE+1];
-    int segment;
-    segment_info info;
+void parse_cancel(const char *data, char *filename, int *segment, int *reply_tag) {
+    int offset = 0;
 
-    int num_segments = *(int *)data;
-    int offset = sizeof(int);
+    get_string(data, offset, filename, MAX_FILENAME);
+    *segment = get_int(data, offset);
+    *reply_tag = get_int(data, offset);
+}
+
+/* HAVE format (from client to client):
+size(bytes):  sizeof(int) | sizeof(int) + len | sizeof(int) | n * sizeof(int) | ...
+              N files     |     filename      |      n      |    segments     | ... (N times)
+Announce the segments received since the last HAVE (fresh, which is cleared) to the peers in the swarm of
+their file, leaving out the segments a peer is already known to hold, so seeds get nothing. The sends do not
+block, so two clients announcing to each other never wait on one another. */
+void send_haves(vector<pair<int, int>> &fresh, vector<client_file> &files, int rank, client_scratch &scratch, send_pool &pool) {
+    /* the fresh segments of each file are next to each other */
+    sort(fresh.begin(), fresh.end());
+
+    /* the peers in the swarms of the files */
+    for (int i = 0; i < (int)fresh.size(); i++) {
+        if (i > 0 && fresh[i].first == fresh[i - 1].first)
+            continue;
+
+        for (int peer: files[fresh[i].first].picker.peers) {
+            if (peer != rank && !scratch.marked[peer]) {
+                scratch.marked[peer] = true;
+                scratch.peers.push_back(peer);
+            }
+        }
+    }
 
-    for (int i = 0; i < num_segments; i++) {
-        /* get filename, segment number and hash from the message */
-        strncpy(filename, data + offset, MAX_FILENAME+1);
-        offset += MAX_FILENAME+1;
+    /* each message is built in a pool buffer whose send completed, and sent from it */
+    for (int peer: scratch.peers) {
+        scratch.marked[peer] = false;
 
-        segment = *(int *)(data + offset);
-        offset += sizeof(int);
+        int slot = pool_take(pool);
+        vector<char> &msg = pool.buffers[slot];
+        int num_files = 0;
+        put_int(msg, 0);
 
-        strncpy(hash, data + offset, HASH_SIZE+1);
-        offset += HASH_SIZE+1;
+        for (int first = 0, last; first < (int)fresh.size(); first = last) {
+            client_file &file = files[fresh[first].first];
 
-        info.seg_no = segment;
-        strncpy(info.hash, hash, HASH_SIZE+1);
+            last = first;
+            while (last < (int)fresh.size() && fresh[last].first == fresh[first].first)
+                last++;
 
-        /* update tracker information */
-        tracker_map[filename][source].push_back(info);
+            if (!picker_knows_peer(file.picker, peer))
+                continue;
+
+            /* the segments the peer is not known to hold already, their count is filled in after them */
+            size_t count_offset = msg.size() + sizeof(int) + file.name.size();
+            int n = 0;
+
+            put_string(msg, file.name.c_str());
+            put_int(msg, 0);
+            for (int i = first; i < last; i++) {
+                if (!picker_knows(file.picker, peer, fresh[i].second)) {
+                    put_int(msg, fresh[i].second);
+                    n++;
+                }
+            }
+
+            if (n == 0) {
+                msg.resize(count_offset - sizeof(int) - file.name.size());
+                continue;
+            }
+
+            memcpy(msg.data() + count_offset, &n, sizeof(int));
+            num_files++;
+        }
+
+        if (num_files == 0)
+            continue;
+
+        memcpy(msg.data(), &num_files, sizeof(int));
+        pool_isend(pool, slot, peer, TAG_HAVE);
     }
+
+    scratch.peers.clear();
+    fresh.clear();
 }
 
-/* Parse the list of files from the tracker, build the mp map.
-   mp[filename][rank] = {list of segments of file with filename owned by peer with given rank}
-*/
-void parse_list_from_tracker(map<string, map<int, list<int>>> &mp, char *data, map<string, map<int, seg_info>> &files) {
+/* Record the segments announced by a peer in the pickers of the files being downloaded. */
+void parse_haves(const char *data, int source, vector<client_file> &files, map<string, int> &file_ids) {
     char filename[MAX_FILENAME+1];
-    int num_peers, rank, num_seg, segment_number, total_segments;
-    seg_info info_segment;
 
-    int num_files = *((int *)data);
-    int offset = sizeof(int);
+    int offset = 0;
+    int num_files = get_int(data, offset);
 
     for (int i = 0; i < num_files; i++) {
-        /* get filename */
-        strncpy(filename, data + offset, MAX_FILENAME+1);
-        offset += MAX_FILENAME+1;
-
-        /* get file information (number of segments + hash of each segment) */
-        total_segments = *(int *)(data + offset);
-        offset += sizeof(int);
-
-        for (int j = 0; j < total_segments; j++) {
-            strncpy(info_segment.hash, data + offset, HASH_SIZE+1);
-            offset += HASH_SIZE +1;
-    
-            info_segment.owned = false;
-
-            if (files[filename].find(j) == files[filename].end())
-                files[filename][j] = info_segment;
+        get_string(data, offset, filename, MAX_FILENAME);
+        int n = get_int(data, offset);
+
+        auto it = file_ids.find(filename);
+        client_file *file = it == file_ids.end() ? NULL : &files[it->second];
+
+        for (int j = 0; j < n; j++) {
+            int segment = get_int(data, offset);
+
+            if (file && file->downloading)
+                picker_add_have(file->picker, source, segment);
         }
+    }
+}
 
-        /* get peers and which segments each one has */
-        num_peers = *(int *)(data + offset);
-        offset += sizeof(int);
+/* Message from client to the tracker informing download finished for file with filename. */
+void send_file_downloaded(const char *filename, int num_trackers, vector<char> &data) {
+    data.clear();
 
-        for (int p = 0; p < num_peers; p++) {
-            rank = *(int *)(data + offset);
-            offset += sizeof(int);
+    put_string(data, filename);
+
+    send_message(data, tracker_of(filename, num_trackers), TAG_FILE_DOWNLOADED);
+}
+
+/* Rank of the tracker shard that owns the file: files are partitioned by the FNV-1a hash of their name. */
+int tracker_of(const char *filename, int num_trackers) {
+    uint32_t h = 2166136261u;
+
+    for (const char *c = filename; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+
+    return TRACKER_RANK + h % num_trackers;
+}
+
+/* Number of the input and output files of the client with the given rank: clients are numbered from 1,
+   after the tracker shards. */
+int client_id(int rank, int num_trackers) {
+    return rank - num_trackers + 1;
+}
+
+/* Update format (from client to tracker shard):
+size(bytes):  sizeof(int)  | sizeof(int) | sizeof(int) | sizeof(int) | num_words * 8  | ...
+             N = num files |   file id   | first word  |  num_words  | bitfield words | ... (N times)
+The words are the part of the file's bitfield holding the segments received since the previous update;
+the file id is the one the shard gave in its peer lists. */
+void parse_update(const char *data, int source, tracker_index &swarms) {
+    vector<uint64_t> words;
+
+    int offset = 0;
+    int num_files = get_int(data, offset);
+
+    for (int i = 0; i < num_files; i++) {
+        int file_id = get_int(data, offset);
+        int first_word = get_int(data, offset);
+        int num_words = get_int(data, offset);
+
+        words.resize(num_words);
+        get_words(data, offset, words.data(), num_words);
+
+        /* update tracker information */
+        if (file_id < 0 || file_id >= (int)swarms.files.size())
+            continue;
+
+        pthread_rwlock_wrlock(&swarms.locks[file_id]);
+        add_peer_bits(swarms.files[file_id], source, first_word, words.data(), num_words);
+        pthread_rwlock_unlock(&swarms.locks[file_id]);
+    }
+}
+
+/* Send the message to the tracker shard if it holds any entry, writing their count at its start, and
+   start a new one. Returns the number of messages sent. */
+static int flush_tracker_message(vector<char> &msg, int &count, int shard, int tag) {
+    if (count == 0)
+        return 0;
+
+    memcpy(msg.data(), &count, sizeof(int));
+    send_message(msg, shard, tag);
+
+    msg.clear();
+    put_int(msg, 0);
+    count = 0;
+
+    return 1;
+}
+
+/* Size the buffers of the download thread for the tracker shards and the peers. */
+void init_client_scratch(client_scratch &scratch, int num_trackers, int numtasks) {
+    scratch.shard_messages.assign(num_trackers, vector<char>());
+    scratch.shard_files.assign(num_trackers, 0);
+    scratch.marked.assign(numtasks, false);
+    scratch.peers.reserve(numtasks);
+
+    /* reserve space for the number of files, filled in once they are counted */
+    for (vector<char> &msg: scratch.shard_messages) {
+        put_int(msg, 0);
+    }
+}
+
+/* Send each tracker shard the segments received since the previous update, one bitfield delta per file
+   trimmed to the words between the first and the last non-zero one. The deltas are cleared. Updates are
+   split so that no message is longer than TRACKER_MESSAGE_SIZE, the size of the tracker's receives. */
+void send_updates(vector<client_file> &files, client_scratch &scratch, int num_trackers) {
+    vector<vector<char>> &data = scratch.shard_messages;
+    vector<int> &num_files = scratch.shard_files;
+
+    for (client_file &file: files) {
+        vector<uint64_t> &bits = file.updated;
+        int first = 0, last = (int)bits.size() - 1;
+
+        while (first <= last && bits[first] == 0)
+            first++;
+        while (last >= first && bits[last] == 0)
+            last--;
+
+        if (first > last)
+            continue;
+
+        int shard = file.shard;
+        int max_words = (TRACKER_MESSAGE_SIZE - 4 * sizeof(int)) / sizeof(uint64_t);
+
+        for (int w = first; w <= last; w += max_words) {
+            int num_words = min(last - w + 1, max_words);
 
-            num_seg = *(int *)(data + offset);
-            offset += sizeof(int);
+            if (data[shard].size() + 3 * sizeof(int) + num_words * sizeof(uint64_t) > TRACKER_MESSAGE_SIZE)
+                flush_tracker_message(data[shard], num_files[shard], shard, TAG_UPDATE);
 
-            for (int j = 0; j < num_seg; j++) {
-                segment_number = *(int *)(data + offset);
-                offset += sizeof(int);
+            put_int(data[shard], file.view.file_id);
+            put_int(data[shard], w);
+            put_int(data[shard], num_words);
+            put_words(data[shard], bits.data() + w, num_words);
+            num_files[shard]++;
+        }
+
+        fill(bits.begin() + first, bits.begin() + last + 1, 0);
+    }
+
+    for (int shard = 0; shard < num_trackers; shard++) {
+        flush_tracker_message(data[shard], num_files[shard], shard, TAG_UPDATE);
+    }
+}
+
+/* Parse the list of files from the tracker: store the hashes of newly discovered files, start a piece
+   picker for each of them and merge the changes to the swarm of each file into its picker. The view of
+   each file keeps the tracker's id of the file and the version of its swarm the client is now up to date
+   with. */
+void parse_list_from_tracker(const char *data, int rank, int numtasks, vector<client_file> &files, map<string, int> &file_ids, map<string, vector<char>> &hashes, client_scratch &scratch) {
+    char filename[MAX_FILENAME+1];
+    int num_peers, peer_rank, num_owned, total_segments;
+    vector<uint64_t> &bits = scratch.bits;
+
+    int offset = 0;
+    int num_files = get_int(data, offset);
 
-                mp[filename][rank].push_back(segment_number);
+    for (int i = 0; i < num_files; i++) {
+        /* get filename, the tracker only lists the files the client asked for */
+        get_string(data, offset, filename, MAX_FILENAME);
+        client_file &file = files[file_ids[filename]];
+
+        file.view.file_id = get_int(data, offset);
+        file.view.epoch = get_int(data, offset);
+
+        /* get file information (number of segments + hash of each segment, in the first list only) */
+        total_segments = get_int(data, offset);
+        int num_hashes = get_int(data, offset);
+
+        /* the hashes are kept in hashes[filename], which the file points to */
+        if (num_hashes > 0 && !file.hashes) {
+            vector<char> &file_hashes = hashes[filename];
+            file_hashes.resize((size_t)num_hashes * HASH_SIZE);
+            get_bytes(data, offset, file_hashes.data(), num_hashes * HASH_SIZE);
+            file.hashes = file_hashes.data();
+        } else {
+            offset += num_hashes * HASH_SIZE;
+        }
+
+        if (total_segments > 0 && !file.downloading) {
+            init_picker(file.picker, total_segments, numtasks, rank);
+            file.downloading = true;
+        }
+
+        /* get the peers that changed and the words of their bitfield that changed */
+        num_peers = get_int(data, offset);
+
+        for (int p = 0; p < num_peers; p++) {
+            peer_rank = get_int(data, offset);
+            num_owned = get_int(data, offset);
+
+            /* seeds are sent without their bitfield */
+            int first_word = 0;
+            if (num_owned == total_segments) {
+                bitfield_fill(bits, total_segments);
+            } else {
+                first_word = get_int(data, offset);
+                bits.resize(get_int(data, offset));
+                get_words(data, offset, bits.data(), bits.size());
             }
+
+            if (file.downloading)
+                picker_add_bitfield(file.picker, peer_rank, first_word, bits.data(), bits.size());
         }
     }
 }
 
 /* Request format (from client to tracker):
-size(bytes):    sizeof(int)        | MAX_FILENAME  | MAX_FILENAME |  ...  |  MAX_FILENAME 
-        N = number of wanted files |   filename1   |   filename2  |  ...  |  filenameN    */
-void send_request_to_tracker(map<string, map<int, seg_info>> &files, map<string, int> &num_segments, map<string, int> &missing_segments) {
-    char data[MAX_MESSAGE_LEN] = {0};
-    int offset = sizeof(int);
-    int num_files = 0;
+size(bytes):    sizeof(int)        | sizeof(int) + len | sizeof(int) |  ...  | sizeof(int) + len | sizeof(int)
+        N = number of wanted files |     filename1     |   epoch1    |  ...  |     filenameN     |   epochN
+The epoch of a file is the version of its swarm in the last peer list received, 0 for the first request.
+Each wanted file is asked from the shard that owns it, in requests of at most TRACKER_MESSAGE_SIZE bytes;
+returns the number of requests sent, each of them is answered with one peer list. */
+int send_request_to_tracker(vector<client_file> &files, client_scratch &scratch, int num_trackers) {
+    vector<vector<char>> &data = scratch.shard_messages;
+    vector<int> &num_files = scratch.shard_files;
+    int num_requests = 0;
 
     /* add the files that have missing segments */
-    for (auto &[filename, m]: files) {
-        if (num_segments[filename] == 0 || missing_segments[filename] > 0) {
-            num_files++;
+    for (client_file &file: files) {
+        if (file.num_segments == 0 || file.missing > 0) {
+            int shard = file.shard;
+
+            if (data[shard].size() + 2 * sizeof(int) + file.name.size() > TRACKER_MESSAGE_SIZE)
+                num_requests += flush_tracker_message(data[shard], num_files[shard], shard, TAG_REQUEST);
 
-            strncpy(data + offset, filename.c_str(), MAX_FILENAME+1);
-            offset += MAX_FILENAME+1;
+            put_string(data[shard], file.name.c_str());
+            put_int(data[shard], file.view.epoch);
+            num_files[shard]++;
         }
     }
 
-    /* add the number of files as the first bytes in the request */
-    strncpy(data, (char *)(&num_files), sizeof(int));
+    for (int shard = 0; shard < num_trackers; shard++) {
+        num_requests += flush_tracker_message(data[shard], num_files[shard], shard, TAG_REQUEST);
+    }
 
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, TRACKER_RANK, TAG_REQUEST, MPI_COMM_WORLD);
+    return num_requests;
 }
 
-/* Response from tracker to client (with peers list). */
-void send_peer_list(char *request, int dest, map<string, map<int, vector<segment_info>>> &tracker_map) {
-    char data[MAX_MESSAGE_LEN];
+/* Build the response from tracker to client (with peers list), holding only what changed in the swarm
+of each file since the epoch given by the client.
+Response format, for each of the N requested files:
+size(bytes): sizeof(int) | sizeof(int) + len | sizeof(int) | sizeof(int) | sizeof(int) | sizeof(int) |  h * HASH_SIZE | sizeof(int) | ...
+             N (once)    |     filename      |   file id   |   version   |      n      |      h      | segment hashes |   P peers   | ...
+The hashes are only sent if the epoch is 0 (h = n, otherwise h = 0). Each of the P peers that changed since
+the epoch, except the client itself, is sent as sizeof(int) rank, sizeof(int) number of owned segments and,
+unless the peer owns all n segments, sizeof(int) first word, sizeof(int) W and the W 64-bit words of its
+bitfield from the first one that changed to the last one that changed. Unknown files have id -1, version 0
+and n = h = P = 0. */
+void build_peer_list(const char *request, int rank, vector<char> &data, tracker_index &swarms) {
     char filename[MAX_FILENAME+1];
 
     /* parse request and build response list */
-    int offset = sizeof(int);
-    int req_offset = sizeof(int);
-    int num_peers, num_seg;
+    int req_offset = 0;
 
     /* total number of files */
-    int num_files = *(int *)request;
-    strncpy(data, (char *)(&num_files), sizeof(int));
+    int num_files = get_int(request, req_offset);
+    data.clear();
+    put_int(data, num_files);
 
     for (int i = 0; i < num_files; i++) {
-        strncpy(filename, request + req_offset, MAX_FILENAME+1);
+        get_string(request, req_offset, filename, MAX_FILENAME);
+        int epoch = get_int(request, req_offset);
 
         /* copy filename */
-        strncpy(data + offset, filename, MAX_FILENAME+1);
-        offset += MAX_FILENAME+1;
-
-        /* copy segments information */
-        int total_segments = 0, seed_rank;
-        for (auto &[rank, list]: tracker_map[filename]) {
-            if ((int)list.size() > total_segments) {
-                total_segments = list.size();
-                seed_rank = rank;
-            }
+        put_string(data, filename);
+
+        int file_id = find_file(swarms, filename);
+        if (file_id == -1) {
+            /* nobody has announced the file yet: no segments and no peers */
+            put_int(data, -1);
+            put_int(data, 0);
+            put_int(data, 0);
+            put_int(data, 0);
+            put_int(data, 0);
+            continue;
         }
 
-        strncpy(data + offset, (char *)&total_segments, sizeof(int));
-        offset += sizeof(int);
+        /* the swarm may be updated by other workers, but not while it is serialized */
+        pthread_rwlock_rdlock(&swarms.locks[file_id]);
+
+        tracker_file &file = swarms.files[file_id];
+        put_int(data, file_id);
+        put_int(data, file.version);
 
-        for (int j = 0; j < total_segments; j++) {
-            strncpy(data + offset, tracker_map[filename][seed_rank][j].hash, HASH_SIZE+1);
-            offset += HASH_SIZE+1;
+        /* copy segments information */
+        put_int(data, file.num_segments);
+        if (epoch == 0) {
+            put_int(data, file.num_segments);
+            put_bytes(data, file.hashes.data(), file.num_segments * HASH_SIZE);
+        } else {
+            put_int(data, 0);
         }
 
-        /* count number of peers */
-        num_peers = tracker_map[filename].size();
-        strncpy(data + offset, (char *)(&num_peers), sizeof(int));
-        offset += sizeof(int);
-
-        for (auto &[rank, list]: tracker_map[filename]) {
-            /* rank of peer */
-            strncpy(data + offset, (char *)(&rank), sizeof(int));
-            offset += sizeof(int);
-
-            /* number of segments of the file */
-            num_seg = list.size();
-            strncpy(data + offset, (char *)(&num_seg), sizeof(int));
-            offset += sizeof(int);
-
-            /* list of segment numbers */
-            for (segment_info &info: list) {
-                strncpy(data + offset, (char *)(&info.seg_no), sizeof(int));
-                offset += sizeof(int);
-            }
+        /* reserve space for the number of peers, filled in once they are counted */
+        int num_peers_offset = data.size();
+        int num_peers = 0;
+        put_int(data, 0);
+
+        for (file_peer &peer: file.peers) {
+            if (peer.version <= epoch || peer.rank == rank)
+                continue;
+
+            /* rank of peer and number of segments of the file */
+            put_int(data, peer.rank);
+            put_int(data, peer.num_owned);
+            num_peers++;
+
+            /* a seed is fully described by its count, the others send the words that changed */
+            if (peer.num_owned == file.num_segments)
+                continue;
+
+            int first = 0, last = (int)peer.bits.size() - 1;
+            while (peer.word_version[first] <= epoch)
+                first++;
+            while (peer.word_version[last] <= epoch)
+                last--;
+
+            put_int(data, first);
+            put_int(data, last - first + 1);
+            put_words(data, peer.bits.data() + first, last - first + 1);
         }
 
-        req_offset += MAX_FILENAME+1;
+        memcpy(data.data() + num_peers_offset, &num_peers, sizeof(int));
+
+        pthread_rwlock_unlock(&swarms.locks[file_id]);
     }
+}
 
-    MPI_Send(data, MAX_MESSAGE_LEN, MPI_CHAR, dest, TAG_PEER_LIST, MPI_COMM_WORLD);
+/* Response from tracker to client (with peers list), sent without blocking from a buffer of the pool;
+   data is used to build it. */
+void send_peer_list(const char *request, int dest, tracker_index &swarms, vector<char> &data, send_pool &pool) {
+    build_peer_list(request, dest, data, swarms);
+
+    pool_isend(pool, data, dest, TAG_PEER_LIST);
 }
 
-/* Finds rank of a peer from which to request the segment. Uses peer_requests map to find the peer with the
-least amount of requests sent from current client, so as to vary the peers as much as possible. */
-int find_peer(map<string, map<int, list<int>>> &mp, string filename, int segment, map<int, int> &peer_requests) {
-    /* find a peer that has the segment */
-    int peer_rank = 0, requests = 0;
-
-    /* get the peer with the least number of requests for variation */
-    for (auto &[rank, list] : mp[filename]) {
-        for (int &s : list) {
-            if (s == segment) {
-                if (peer_requests.find(rank) == peer_requests.end()) {
-                    peer_rank = rank;
-                    peer_requests[rank] = 1;
-                    return peer_rank;
-
-                } else if (peer_rank == 0 || peer_requests[rank] < requests) {
-                    peer_rank = rank;
-                    requests = peer_requests[rank];
-                }
-                break;
-            }
-        }
+/* A received segment is valid if its SHA-256 digest, written in hex, starts with the hash given by
+   the tracker. Files announced with hashes only are seeded with segments generated from the hash
+   (see fill_synthetic_segment); for those, the payload must be exactly the generated one.
+   scratch must hold a whole segment. */
+bool verify_segment(const char *payload, int len, const unsigned char *digest, const char *hash, vector<char> &scratch) {
+    static const char hex[] = "0123456789abcdef";
+
+    if (len != (int)scratch.size())
+        return false;
+
+    bool matches = true;
+    for (int i = 0; i < HASH_SIZE / 2 && matches; i++) {
+        matches = tolower(hash[2*i]) == hex[digest[i] >> 4] && tolower(hash[2*i + 1]) == hex[digest[i] & 0xf];
     }
 
-    /* update number of requests sent to the peer */
-    peer_requests[peer_rank] = requests + 1;
+    if (matches)
+        return true;
 
-    return peer_rank;
+    fill_synthetic_segment(scratch.data(), hash, HASH_SIZE, len);
+    return !memcmp(payload, scratch.data(), len);
 }
 
-/* Update the number of missing segments for each file. */
-void update_missing_segments(map<string, map<int, list<int>>> &mp, map<string, int> &num_segments, map<string, int> &missing_segments, int *needed) {
-    int total_segments;
+/* The peer sent a corrupted segment: it is no longer a holder of the segment unless it was the last one
+   (see picker_remove_holder), the segment goes back to the candidates, and the peer is penalized so that
+   find_peer prefers other peers. */
+void reject_segment(piece_picker &picker, int rank, int segment, peer_stats &load) {
+    picker_remove_holder(picker, rank, segment);
+    unpick_segment(picker, segment);
 
-    for (auto &[filename, m]: mp) {
-        if (num_segments[filename] == 0) {
-            /* get the number of segments of the file (the list with the most elements - list of the seed) */
-            total_segments = 0;
-            for (auto &[rank, list]: m) {
-                total_segments = max(total_segments, (int)list.size());
-            }
+    load.peers[rank].penalty += BAD_SEGMENT_PENALTY;
+}
+
+/* Pick the next segment of the file to request and the peer to ask for it (see pick_segment and find_peer).
+   A segment whose holders all choke the client is put back, and the next one is tried, up to
+   CHOKED_PICKS of them. Returns -1 if no segment can be asked for now. */
+int pick_request(piece_picker &picker, peer_stats &load, const vector<bool> &local, int &peer_rank) {
+    int skipped[CHOKED_PICKS];
+    int num_skipped = 0;
+    int segment = -1;
+
+    peer_rank = -1;
+    while (peer_rank == -1 && num_skipped < CHOKED_PICKS) {
+        segment = pick_segment(picker);
+        if (segment == -1)
+            break;
+
+        peer_rank = find_peer(picker, segment, load, local);
+        if (peer_rank == -1)
+            skipped[num_skipped++] = segment;
+    }
+
+    for (int i = 0; i < num_skipped; i++) {
+        unpick_segment(picker, skipped[i]);
+    }
+
+    return peer_rank == -1 ? -1 : segment;
+}
+
+/* Whether the segment is already asked from the peer by a request in flight other than slot skip. */
+static bool already_asked(vector<download_slot> &slots, int skip, int peer_rank) {
+    download_slot &slot = slots[skip];
+
+    for (int j = 0; j < (int)slots.size(); j++) {
+        if (slots[j].busy && !slots[j].cancelled && slots[j].segment == slot.segment &&
+            slots[j].file == slot.file && slots[j].peer == peer_rank)
+            return true;
+    }
+
+    return false;
+}
+
+/* Endgame: when a file has at most ENDGAME_SEGMENTS missing segments, a segment in flight is also asked
+   from other holders, up to ENDGAME_REQUESTS requests at once; the first valid copy wins and the other
+   requests are cancelled. Returns false if no segment in flight can be asked from another holder. */
+bool next_duplicate(vector<download_slot> &slots, vector<client_file> &files, peer_stats &load, int &file, int &segment,
+                    int &peer_rank) {
+    for (int i = 0; i < (int)slots.size(); i++) {
+        download_slot &slot = slots[i];
+        if (!slot.busy || slot.cancelled || files[slot.file].missing > ENDGAME_SEGMENTS)
+            continue;
+
+        /* the number of requests for the segment */
+        int asked = 0;
+        for (int j = 0; j < (int)slots.size(); j++) {
+            if (slots[j].busy && !slots[j].cancelled && slots[j].segment == slot.segment &&
+                slots[j].file == slot.file)
+                asked++;
+        }
+
+        if (asked >= ENDGAME_REQUESTS)
+            continue;
+
+        /* the holder not asked yet that is expected to deliver first */
+        peer_rank = -1;
+        piece_picker &picker = files[slot.file].picker;
+        for (int holder: picker.peers) {
+            if (load.peers[holder].choked || !picker_is_holder(picker, holder, slot.segment) ||
+                already_asked(slots, i, holder))
+                continue;
 
-            num_segments[filename] = total_segments;
-            missing_segments[filename] = total_segments;
-            *needed = *needed + total_segments;
+            if (peer_rank == -1 || expected_completion(load, holder) < expected_completion(load, peer_rank))
+                peer_rank = holder;
         }
+
+        if (peer_rank == -1)
+            continue;
+
+        load.peers[peer_rank].requests++;
+        file = slot.file;
+        segment = slot.segment;
+        return true;
+    }
+
+    return false;
+}
+
+/* Cancel the other requests in flight for a segment that was just received: the peers reply with an
+   empty message if the request is still queued, the reply is ignored either way. With rma_fetch (-r),
+   only the requests for the address of a store are sent to the peer, the others are MPI_Get. */
+void cancel_duplicates(vector<download_slot> &slots, vector<client_file> &files, int winner, bool rma_fetch,
+                       vector<char> &data) {
+    download_slot &won = slots[winner];
+
+    for (int i = 0; i < (int)slots.size(); i++) {
+        download_slot &slot = slots[i];
+        if (i == winner || !slot.busy || slot.cancelled || slot.segment != won.segment ||
+            slot.file != won.file)
+            continue;
+
+        slot.cancelled = true;
+
+        /* a fetch with MPI_Get cannot be called back, its data is dropped when it completes */
+        if (!rma_fetch || slot.locating)
+            send_cancel(files[slot.file].name.c_str(), slot.segment, TAG_SEGMENT_BASE + i, slot.peer, data);
     }
 }
 
-/* Print segments hash in order to the output file. */
-void print_info_to_file(int rank, string filename, map<string, int> &num_segments, map<string, map<int, seg_info>> &files) {
-    char output_filename[100] = {0};
-    sprintf(output_filename, "client%d_%s", rank, filename.c_str());
+/* Count the segments of each newly discovered file as missing. */
+void update_missing_segments(vector<client_file> &files, int *needed) {
+    for (client_file &file: files) {
+        if (file.downloading && file.num_segments == 0) {
+            file.num_segments = file.picker.num_segments;
+            file.missing = file.picker.num_segments;
+            file.owned.assign(bitfield_words(file.num_segments), 0);
+            file.updated.assign(bitfield_words(file.num_segments), 0);
+            *needed = *needed + file.num_segments;
+        }
+    }
+}
+
+/* Gather the stats of every rank on the first tracker, which writes them to path as JSON. Times are
+   in seconds since the start of each rank. */
+void write_report(const char *path, run_stats &stats, int rank, int numtasks, int num_trackers, int segment_size) {
+    double end = MPI_Wtime();
+    double mine[7] = {
+        stats.first_file ? stats.first_file - stats.start : -1,
+        stats.end ? stats.end - stats.start : -1,
+        end - stats.start,
+        (double)stats.segments,
+        (double)stats.tracker_messages,
+        stats.ready - stats.start,
+        (double)stats.uploads,
+    };
+    vector<double> all(rank == TRACKER_RANK ? numtasks * 7 : 0);
+
+    MPI_Gather(mine, 7, MPI_DOUBLE, all.data(), 7, MPI_DOUBLE, TRACKER_RANK, MPI_COMM_WORLD);
+
+    if (rank != TRACKER_RANK)
+        return;
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        return;
+    }
+
+    double wall = 0, startup = 0;
+    long tracker_messages = 0;
+    for (int r = 0; r < numtasks; r++) {
+        wall = max(wall, all[r * 7 + 2]);
+        startup = max(startup, all[r * 7 + 5]);
+        if (r < num_trackers)
+            tracker_messages += all[r * 7 + 4];
+    }
+
+    fprintf(fp, "{\n  \"ranks\": %d,\n  \"trackers\": %d,\n  \"segment_size\": %d,\n", numtasks, num_trackers, segment_size);
+    fprintf(fp, "  \"wall_seconds\": %.6f,\n  \"startup_seconds\": %.6f,\n", wall, startup);
+    fprintf(fp, "  \"tracker_messages\": %ld,\n  \"clients\": [\n", tracker_messages);
 
-    FILE *fp = fopen(output_filename, "a+");
+    for (int r = num_trackers; r < numtasks; r++) {
+        double *c = &all[r * 7];
 
-    for (int sn = 0; sn < num_segments[filename]; sn++) {
-        fprintf(fp, "%s\n", files[filename][sn].hash);
+        fprintf(fp, "    {\"client\": %d, \"segments\": %ld, \"uploads\": %ld, \"download_seconds\": %.6f, \"first_file_seconds\": %.6f}%s\n",
+                client_id(r, num_trackers), (long)c[3], (long)c[6], c[1], c[0], r + 1 < numtasks ? "," : "");
     }
 
+    fprintf(fp, "  ]\n}\n");
     fclose(fp);
 }
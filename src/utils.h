@@ -5,11 +5,28 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ctype.h>
 #include <map>
 #include <cstring>
 #include <string>
 #include <vector>
 #include <list>
+#include <algorithm>
+
+#include "message.h"
+#include "tracker_index.h"
+#include "piece_picker.h"
+#include "segment_store.h"
+#include "sha256.h"
+#include "metrics.h"
+#include "work_queue.h"
+#include "node_share.h"
+#include "manifest.h"
+#include "peer_stats.h"
+#include "disk_writer.h"
+#include "choker.h"
 
 #define TRACKER_RANK 0
 #define MAX_FILES 10
@@ -17,9 +34,6 @@
 #define HASH_SIZE 32
 #define MAX_CHUNKS 100
 
-#define MAX_MESSAGE_LEN 40000
-
-#define TAG_ACK 1
 #define TAG_FIN 2
 #define TAG_REQUEST 3
 #define TAG_SEGMENT 4
@@ -27,37 +41,182 @@
 #define TAG_PEER_LIST 6
 #define TAG_FILE_DOWNLOADED 7
 #define TAG_CLIENT_INIT 8
+#define TAG_CANCEL 9
+#define TAG_HAVE 10
+
+/* replies to segment requests are sent with tag TAG_SEGMENT_BASE + the requester's slot */
+#define TAG_SEGMENT_BASE 100
+
+/* the tracker keeps TRACKER_RECEIVES receives of TRACKER_MESSAGE_SIZE bytes posted, and handles the
+   messages with TRACKER_WORKERS threads; clients split longer requests and updates */
+#define TRACKER_RECEIVES 16
+#define TRACKER_MESSAGE_SIZE 65536
+#define TRACKER_WORKERS 4
+
+/* the upload thread of a client keeps UPLOAD_RECEIVES receives posted for segment requests (which are at
+   most UPLOAD_REQUEST_SIZE bytes) and queues them for UPLOAD_WORKERS threads, at most UPLOAD_QUEUE_DEPTH
+   per requester; requests beyond that get an empty reply. UPLOAD_CANCEL_RECEIVES receives are kept posted
+   for cancellations */
+#define UPLOAD_RECEIVES 16
+#define UPLOAD_CANCEL_RECEIVES 4
+#define UPLOAD_REQUEST_SIZE (3 * sizeof(int) + MAX_FILENAME + HASH_SIZE)
+#define UPLOAD_WORKERS 2
+#define UPLOAD_QUEUE_DEPTH 16
+
+#define DOWNLOAD_WINDOW 8
+/* endgame: once a file has at most ENDGAME_SEGMENTS missing segments, each of them is requested from up to
+   ENDGAME_REQUESTS holders at once */
+#define ENDGAME_SEGMENTS 8
+#define ENDGAME_REQUESTS 3
+/* segments tried in a row when their holders all choke the client (-k), before waiting for the next peer list */
+#define CHOKED_PICKS 8
+/* counted as requests ahead of any new one at a peer that sent a corrupted segment, so find_peer avoids it */
+#define BAD_SEGMENT_PENALTY 100
+/* segments received between two updates to the tracker, each followed by a new peer list; in between,
+   clients learn about new segments from the HAVE messages of their peers, sent every HAVE_BATCH segments */
+#define UPDATE_INTERVAL 50
+#define HAVE_BATCH 16
+/* a HAVE carries at most HAVE_BATCH segments, so it fits in HAVE_MESSAGE_SIZE bytes */
+#define HAVE_MESSAGE_SIZE (sizeof(int) + HAVE_BATCH * (3 * sizeof(int) + MAX_FILENAME))
+/* segment number of a request for the address of the peer's store of the file in the store window (-r) */
+#define LOCATE_SEGMENT -1
 
 using namespace std;
 
+/* What a client knows of the swarm of a file: the file's id at its tracker shard and the version of the
+   swarm in the last peer list received (0 before the first one). */
 typedef struct {
-    char hash[HASH_SIZE+1];
-    bool owned;
-} seg_info;
+    int file_id;
+    int epoch;
+} swarm_view;
 
+/* A file the client owns or wants. Files are interned when the input is read: the client refers to them
+   by their index in its file table, and the state of each segment is kept in flat per-file arrays. */
+typedef struct {
+    string name;
+    /* number of segments, 0 for a wanted file until its first peer list; missing counts those not owned */
+    int num_segments;
+    int missing;
+    /* HASH_SIZE characters per segment, not null terminated: in the client's mapped binary input or in
+       segment_hashes[name] */
+    const char *hashes;
+    /* owned[s] = the client has segment s; updated = segments received since the last update to the tracker */
+    vector<uint64_t> owned;
+    vector<uint64_t> updated;
+    /* peer lists only hold the changes since view.epoch */
+    swarm_view view;
+    int shard;
+    /* segment availability and selection state, started by the first peer list of a wanted file */
+    bool downloading;
+    piece_picker picker;
+    /* the contents of the file in memory, NULL until created; it is owned by stores[name] */
+    segment_store *store;
+    /* with -r, remote[rank] = the address of the peer's store of the file in the store window, 0 if unknown */
+    vector<MPI_Aint> remote;
+    /* with -l, where the file goes in the client's shared region (NULL if it is not shared), and
+       node_files[rank] = the file in the region of a peer on the node, once node_known[rank] */
+    char *shared;
+    vector<char *> node_files;
+    vector<bool> node_known;
+} client_file;
+
+/* Buffers of the download thread, kept across rounds so that building the messages of a round does not
+   allocate once they have grown to their working size. */
+typedef struct {
+    /* the request or update being built for each tracker shard, and the number of files it lists */
+    vector<vector<char>> shard_messages;
+    vector<int> shard_files;
+    /* the peers a HAVE goes to, marked[rank] once the peer is in the list */
+    vector<int> peers;
+    vector<bool> marked;
+    vector<uint64_t> bits;
+} client_scratch;
+
+typedef struct {
+    /* index of the file in the client's file table */
+    int file;
+    int segment;
+    int peer;
+    vector<char> request;
+    MPI_Request send_request;
+    /* where the segment is received and how many bytes arrived */
+    vector<char> buffer;
+    int received;
+    /* the received segment: the buffer, or the segment in the store of a peer on this node (-l) */
+    const char *source;
+    /* a request is in flight, its reply not handled yet */
+    bool busy;
+    /* another copy of the segment was received first, the reply is ignored */
+    bool cancelled;
+    /* the request asks the peer where its store of the file is, the segment is fetched with MPI_Get next (-r) */
+    bool locating;
+    /* when the request was sent, for the round trip metrics */
+    double requested;
+} download_slot;
+
+/* MPI_Wtime timestamps (0 if the event did not happen) and counters of a rank, for the run report */
 typedef struct {
-    int seg_no;
-    char hash[HASH_SIZE+1];
-} segment_info;
+    double start;
+    /* end of the bootstrap: manifests indexed by the tracker shards */
+    double ready;
+    double first_file;
+    double end;
+    long segments;
+    long tracker_messages;
+    /* segments sent to other clients, by the upload workers */
+    long uploads;
+} run_stats;
+
+void send_file_request(const char *filename, const char *hash, int segment, int dest, int reply_tag, vector<char> &data, MPI_Request *request);
+
+void parse_file_request(const char *data, char *filename, int *segment, int *reply_tag);
+
+void send_cancel(const char *filename, int segment, int reply_tag, int dest, vector<char> &data);
+
+void parse_cancel(const char *data, char *filename, int *segment, int *reply_tag);
+
+void send_haves(vector<pair<int, int>> &fresh, vector<client_file> &files, int rank, client_scratch &scratch, send_pool &pool);
+
+void parse_haves(const char *data, int source, vector<client_file> &files, map<string, int> &file_ids);
+
+void send_file_downloaded(const char *filename, int num_trackers, vector<char> &data);
+
+int tracker_of(const char *filename, int num_trackers);
+
+int client_id(int rank, int num_trackers);
+
+void parse_update(const char *data, int source, tracker_index &swarms);
+
+void init_client_scratch(client_scratch &scratch, int num_trackers, int numtasks);
+
+void send_updates(vector<client_file> &files, client_scratch &scratch, int num_trackers);
+
+void parse_list_from_tracker(const char *data, int rank, int numtasks, vector<client_file> &files, map<string, int> &file_ids, map<string, vector<char>> &hashes, client_scratch &scratch);
+
+int send_request_to_tracker(vector<client_file> &files, client_scratch &scratch, int num_trackers);
+
+void put_manifest_file(vector<char> &data, const char *filename, int num_segments, const char *hashes);
 
-void send_file_request(const char *filename, char *hash, int segment);
+void add_files_to_index(const char *data, int rank, tracker_index &swarms);
 
-void send_file_downloaded(const char *filename);
+void build_peer_list(const char *request, int rank, vector<char> &data, tracker_index &swarms);
 
-void parse_update(char *data, int source, map<string, map<int, vector<segment_info>>> &tracker_map);
+void send_peer_list(const char *request, int dest, tracker_index &swarms, vector<char> &data, send_pool &pool);
 
-void parse_list_from_tracker(map<string, map<int, list<int>>> &mp, char *data, map<string, map<int, seg_info>> &files);
+bool verify_segment(const char *payload, int len, const unsigned char *digest, const char *hash, vector<char> &scratch);
 
-void send_request_to_tracker(map<string, map<int, seg_info>> &files, map<string, int> &num_segments, map<string, int> &missing_segments);
+void reject_segment(piece_picker &picker, int rank, int segment, peer_stats &load);
 
-void add_files_to_map(char *data, int rank, map<string, map<int, vector<segment_info>>> &tracker_map);
+int pick_request(piece_picker &picker, peer_stats &load, const vector<bool> &local, int &peer_rank);
 
-void send_peer_list(char *request, int dest, map<string, map<int, vector<segment_info>>> &tracker_map);
+bool next_duplicate(vector<download_slot> &slots, vector<client_file> &files, peer_stats &load, int &file, int &segment,
+                    int &peer_rank);
 
-int find_peer(map<string, map<int, list<int>>> &mp, string filename, int segment, map<int, int> &peer_requests);
+void cancel_duplicates(vector<download_slot> &slots, vector<client_file> &files, int winner, bool rma_fetch,
+                       vector<char> &data);
 
-void update_missing_segments(map<string, map<int, list<int>>> &mp, map<string, int> &num_segments,map<string, int> &missing_segments, int *needed_segments);
+void update_missing_segments(vector<client_file> &files, int *needed_segments);
 
-void print_info_to_file(int rank, string filename, map<string, int> &num_segments, map<string, map<int, seg_info>> &files);
+void write_report(const char *path, run_stats &stats, int rank, int numtasks, int num_trackers, int segment_size);
 
 #endif
\ No newline at end of file
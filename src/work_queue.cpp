@@ -0,0 +1,245 @@
+#include "work_queue.h"
+#include "utils.h"
+
+#include <time.h>
+#include <algorithm>
+
+void init_queue(work_queue &queue) {
+    queue.items.clear();
+    queue.closed = false;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+}
+
+/* Move from to the empty item to, leaving from empty. */
+static void move_item(work_item &to, work_item &from) {
+    to.source = from.source;
+    to.tag = from.tag;
+    to.key = from.key;
+    to.received = from.received;
+    to.data.swap(from.data);
+}
+
+/* Add the item at the end of the queue; its data is moved to the queue, item is left empty. */
+void queue_push(work_queue &queue, work_item &item) {
+    pthread_mutex_lock(&queue.lock);
+
+    queue.items.emplace_back();
+    move_item(queue.items.back(), item);
+
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Wait for the first item of the queue and move it to item. Returns false once the queue is closed
+   and every item was taken. */
+bool queue_pop(work_queue &queue, work_item &item) {
+    pthread_mutex_lock(&queue.lock);
+
+    while (queue.items.empty() && !queue.closed)
+        pthread_cond_wait(&queue.not_empty, &queue.lock);
+
+    if (queue.items.empty()) {
+        pthread_mutex_unlock(&queue.lock);
+        return false;
+    }
+
+    move_item(item, queue.items.front());
+    queue.items.pop_front();
+
+    pthread_mutex_unlock(&queue.lock);
+    return true;
+}
+
+/* No more items will be pushed: wake up the workers, they stop once the queue is empty. */
+void close_queue(work_queue &queue) {
+    pthread_mutex_lock(&queue.lock);
+
+    queue.closed = true;
+    pthread_cond_broadcast(&queue.not_empty);
+
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Seconds on the monotonic clock, the default clock of a peer_queue. */
+static double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void init_peer_queue(peer_queue &queue, int depth) {
+    queue.pending.clear();
+    queue.ready.clear();
+    queue.not_before.clear();
+    queue.clock = monotonic_seconds;
+    queue.depth = depth;
+    queue.size = 0;
+    queue.closed = false;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.not_empty, NULL);
+}
+
+/* Add the item at the end of the queue of its source, moving its data. Returns false, leaving item as
+   it is, if the source already has depth items waiting. */
+bool peer_queue_push(peer_queue &queue, work_item &item) {
+    pthread_mutex_lock(&queue.lock);
+
+    deque<work_item> &pending = queue.pending[item.source];
+
+    if ((int)pending.size() >= queue.depth) {
+        pthread_mutex_unlock(&queue.lock);
+        return false;
+    }
+
+    if (pending.empty())
+        queue.ready.push_back(item.source);
+
+    pending.emplace_back();
+    move_item(pending.back(), item);
+    queue.size++;
+
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+    return true;
+}
+
+/* Take the next item of the first source in line that is not deferred, with the lock held. Returns false
+   if there is none; wait is then the seconds until the first deferred source may be served, -1 if no item
+   is waiting. */
+static bool take_item(peer_queue &queue, work_item &item, double *wait) {
+    double now = queue.not_before.empty() ? 0 : queue.clock();
+    *wait = -1;
+
+    auto first = queue.ready.begin();
+    for (; first != queue.ready.end(); first++) {
+        auto deferred = queue.not_before.find(*first);
+        if (deferred == queue.not_before.end())
+            break;
+
+        if (deferred->second <= now) {
+            queue.not_before.erase(deferred);
+            break;
+        }
+
+        if (*wait < 0 || deferred->second - now < *wait)
+            *wait = deferred->second - now;
+    }
+
+    if (first == queue.ready.end())
+        return false;
+
+    int source = *first;
+    queue.ready.erase(first);
+
+    deque<work_item> &pending = queue.pending[source];
+    move_item(item, pending.front());
+    pending.pop_front();
+    queue.size--;
+
+    /* the source goes to the back of the line if it has more items */
+    if (!pending.empty())
+        queue.ready.push_back(source);
+
+    return true;
+}
+
+/* Wait for an item and move it to item, taking the sources in turn. Returns false once the queue is
+   closed; the items still waiting then are dropped. */
+bool peer_queue_pop(peer_queue &queue, work_item &item) {
+    double wait;
+
+    pthread_mutex_lock(&queue.lock);
+
+    while (!queue.closed && !take_item(queue, item, &wait)) {
+        if (wait < 0) {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+            continue;
+        }
+
+        /* every waiting source is deferred, sleep until the first of them is due */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        long nsec = until.tv_nsec + (long)(wait * 1e9);
+        until.tv_sec += nsec / 1000000000L;
+        until.tv_nsec = nsec % 1000000000L;
+
+        pthread_cond_timedwait(&queue.not_empty, &queue.lock, &until);
+    }
+
+    bool taken = !queue.closed;
+
+    pthread_mutex_unlock(&queue.lock);
+    return taken;
+}
+
+/* Move the next item to item without waiting, as peer_queue_pop. Returns false if no source can be served
+   now: wait is then the seconds until a deferred one can, -1 if no item is waiting. */
+bool peer_queue_try_pop(peer_queue &queue, work_item &item, double *wait) {
+    pthread_mutex_lock(&queue.lock);
+    bool taken = take_item(queue, item, wait);
+    pthread_mutex_unlock(&queue.lock);
+
+    return taken;
+}
+
+/* Leave the items of source waiting for delay seconds from now, or longer if it is already deferred. */
+void peer_queue_defer(peer_queue &queue, int source, double delay) {
+    pthread_mutex_lock(&queue.lock);
+
+    double until = queue.clock() + delay;
+    auto deferred = queue.not_before.find(source);
+    if (deferred == queue.not_before.end())
+        queue.not_before[source] = until;
+    else
+        deferred->second = max(deferred->second, until);
+
+    pthread_mutex_unlock(&queue.lock);
+}
+
+/* Change the tag of the waiting segment request of source with the given key (its reply tag) for segment of
+   filename, e.g. to mark it as cancelled. A reply tag is reused by the requester as soon as its request is
+   answered, so a cancel that arrives late must not hit a newer request on the same tag. Returns false if
+   there is no such item, because it was already taken or never pushed. */
+bool peer_queue_retag(peer_queue &queue, int source, int key, const char *filename, int segment, int tag) {
+    char item_filename[MAX_FILENAME+1];
+    int item_segment, reply_tag;
+    bool found = false;
+
+    pthread_mutex_lock(&queue.lock);
+
+    for (work_item &item: queue.pending[source]) {
+        if (item.key != key)
+            continue;
+
+        parse_file_request(item.data.data(), item_filename, &item_segment, &reply_tag);
+        if (item_segment == segment && !strcmp(item_filename, filename)) {
+            item.tag = tag;
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+    return found;
+}
+
+/* Number of items waiting, of all the sources. */
+int peer_queue_size(peer_queue &queue) {
+    pthread_mutex_lock(&queue.lock);
+    int size = queue.size;
+    pthread_mutex_unlock(&queue.lock);
+
+    return size;
+}
+
+/* Stop the workers, without waiting for the items left. */
+void close_peer_queue(peer_queue &queue) {
+    pthread_mutex_lock(&queue.lock);
+
+    queue.closed = true;
+    pthread_cond_broadcast(&queue.not_empty);
+
+    pthread_mutex_unlock(&queue.lock);
+}
@@ -0,0 +1,73 @@
+#ifndef __WORK_QUEUE_H__
+#define __WORK_QUEUE_H__
+
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+/* A received message waiting to be handled by a worker thread. */
+typedef struct {
+    int source;
+    int tag;
+    /* identifies the item among the items of its source, e.g. the reply tag of a segment request */
+    int key;
+    /* MPI_Wtime when the message was received, for the latency metrics */
+    double received;
+    vector<char> data;
+} work_item;
+
+/* Messages handed from the thread that receives them to a pool of worker threads. */
+typedef struct {
+    deque<work_item> items;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} work_queue;
+
+/* Messages from several sources handed to a pool of worker threads: each source has its own queue of at
+   most depth items, and the workers take one item of each source in turn, so a source with many
+   messages does not delay the others. A source can be deferred, its items are then left waiting until
+   a given time while the others are served. */
+typedef struct {
+    map<int, deque<work_item>> pending;
+    /* sources with pending items, in the order they are served */
+    deque<int> ready;
+    /* not_before[source] = when its items may be taken again, in seconds of clock */
+    map<int, double> not_before;
+    double (*clock)(void);
+    int depth;
+    /* items waiting, of all the sources */
+    int size;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+} peer_queue;
+
+void init_queue(work_queue &queue);
+
+void queue_push(work_queue &queue, work_item &item);
+
+bool queue_pop(work_queue &queue, work_item &item);
+
+void close_queue(work_queue &queue);
+
+void init_peer_queue(peer_queue &queue, int depth);
+
+bool peer_queue_push(peer_queue &queue, work_item &item);
+
+bool peer_queue_pop(peer_queue &queue, work_item &item);
+
+bool peer_queue_try_pop(peer_queue &queue, work_item &item, double *wait);
+
+void peer_queue_defer(peer_queue &queue, int source, double delay);
+
+bool peer_queue_retag(peer_queue &queue, int source, int key, const char *filename, int segment, int tag);
+
+int peer_queue_size(peer_queue &queue);
+
+void close_peer_queue(peer_queue &queue);
+
+#endif